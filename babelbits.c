@@ -30,159 +30,1584 @@
 #include <string.h>  //Needed for calculating string sizes
 
 #include "babelbits.h"
+#include "babelbits_bits.h"
+
+//Built-in message handlers
+static void bb_handle_handshake(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen);
+static void bb_handle_ack(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen);
+static void bb_handle_subscribe(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen);
+static void bb_handle_unsubscribe(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen);
+static void bb_handle_txtpacket(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen);
+static void bb_handle_batch(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen);
+#if BB_MAX_NCOMMANDS > 0
+static void bb_handle_command(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen);
+#endif
+static bbMsgHandler bb_builtin_handler(uint8_t msgType);
+
+static uint8_t bb_encoding_valid(uint8_t type, const bbEncoding* p_enc);
+
+//Outgoing message buffer management
+static uint8_t* bb_out_begin(bbInstance* p_bb, uint16_t msgLen);
+static void bb_out_commit(bbInstance* p_bb, uint16_t msgLen);
+
+
+void bb_init(bbInstance* p_bb, uint8_t* p_buf, uint16_t buflen)
+{
+  uint8_t i = 0;
+#ifndef BB_ROM_FIELDS
+  bbField* p_field;
+#endif
+
+  p_bb->nfields = 0; //Reset number of registered fields to zero
+
+  p_bb->p_out_msgbuf = p_buf;
+  p_bb->out_msgbuf_len = buflen;
+  p_bb->out_bytes_waiting = 0;
+
+  p_bb->batch_max_bytes = 0;
+  p_bb->batch_max_delay = 0;
+  p_bb->batch_len = 0;
+  p_bb->batch_nmsgs = 0;
+  p_bb->batch_timing = 0;
+  p_bb->batch_start = 0;
+
+  p_bb->connection_state = BB_NO_CONNECTION;
+  p_bb->txt_msg_handler = 0;
+
+  //Clear all fields & subscriptions
+#ifdef BB_ROM_FIELDS
+  p_bb->fields = 0;
+#endif
+  for(i = 0; i < BB_MAX_NFIELDS; i++)
+    {
+#ifndef BB_ROM_FIELDS
+      p_field = &(p_bb->fields[i]);  //Clear field
+      p_field->p_var = 0;
+      p_field->type = UNKNOWN;
+      p_field->name[0] = 0;  //Null the string
+#endif
+
+      p_bb->field_groups[i] = BB_NO_GROUP;
+    }
+  memset(p_bb->subscriptions, 0, BB_FIELD_MASKLEN);
+
+#if BB_MAX_NDEADBANDS > 0
+  for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+    p_bb->deadbands[i].mode = BB_SUB_PERIODIC;
+#endif
+
+  p_bb->ngroups = 0;
+  for(i = 0; i < BB_MAX_NGROUPS; i++)
+    p_bb->p_groups[i] = 0;
+
+#if BB_MAX_NCOMMANDS > 0
+  p_bb->ncommands = 0;
+#ifdef BB_ROM_FIELDS
+  p_bb->commands = 0;
+#endif
+#endif
+  p_bb->encodings = 0;
+
+  //Install built-in handlers. BB_REQUEST_AVAILABLE_FIELDS, BB_PUBLISH and
+  //BB_TMPACKET are left for the application to register.
+#if BB_MAX_MSGTYPES > 0
+  for(i = 0; i < BB_MAX_MSGTYPES; i++)
+    p_bb->msg_handlers[i] = bb_builtin_handler(i);
+#endif
+}
+
+
+// Handler babelbits itself provides for a message type, or 0
+static bbMsgHandler bb_builtin_handler(uint8_t msgType)
+{
+  switch(msgType)
+    {
+    case BB_HANDSHAKE_INIT: return &bb_handle_handshake;
+    case BB_ACK:            return &bb_handle_ack;
+    case BB_SUBSCRIBE:      return &bb_handle_subscribe;
+    case BB_UNSUBSCRIBE:    return &bb_handle_unsubscribe;
+    case BB_TXTPACKET:      return &bb_handle_txtpacket;
+    case BB_BATCH:          return &bb_handle_batch;
+#if BB_MAX_NCOMMANDS > 0
+    case BB_COMMAND:        return &bb_handle_command;
+#endif
+    default:                return 0;
+    }
+}
+
+// Installs (or replaces, or w/ 0 removes) the handler for a message type.
+// Custom types should start at BB_USER_MSGTYPE. Returns -1 if msgType
+// is past the table, always when it's compiled out (BB_MAX_MSGTYPES 0).
+int8_t bb_register_handler(bbInstance* p_bb, uint8_t msgType, bbMsgHandler p_handler)
+{
+#if BB_MAX_MSGTYPES > 0
+  if(msgType >= BB_MAX_MSGTYPES) return -1;
+
+  p_bb->msg_handlers[msgType] = p_handler;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+
+void bb_processMessage(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  uint8_t msgType;
+  bbMsgHandler p_handler;
+
+#ifdef BB_TRACE_ENABLE
+  uint16_t i;
+
+  BB_TRACE("Message received: \"");
+  for (i = 0; i < msgLen; ++i)
+    BB_TRACE("%c", p_msg[i]);
+  BB_TRACE("\"\n");
+#endif
+
+  if(msgLen == 0) return;
+
+  //Look up handler by message type, pass it the inner message
+  msgType = p_msg[0];
+
+#if BB_MAX_MSGTYPES > 0
+  p_handler = (msgType < BB_MAX_MSGTYPES) ? p_bb->msg_handlers[msgType] : 0;
+#else
+  p_handler = bb_builtin_handler(msgType);
+#endif
+
+  if(p_handler != 0)
+    p_handler(p_bb, &(p_msg[1]), msgLen - 1);
+  else
+    BB_TRACE("Error: no handler for packet type %d\n", msgType);
+}
+
+static void bb_handle_handshake(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  p_bb->connection_state = BB_CONNECTED;
+}
+
+static void bb_handle_ack(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  if(p_bb->connection_state == BB_HANDSHAKE_SENT)
+    p_bb->connection_state = BB_CONNECTED;
+}
+
+static void bb_handle_subscribe(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  if(msgLen >= sizeof(bbMsg_SubscribeOnChange))
+    bb_process_subscribe_onchange(p_bb, (bbMsg_SubscribeOnChange*)p_msg);
+  else if(msgLen >= sizeof(bbMsg_Subscribe))
+    bb_process_subscribe(p_bb, (bbMsg_Subscribe*)p_msg);
+}
+
+static void bb_handle_unsubscribe(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  if(msgLen < sizeof(bbMsg_Unsubscribe)) return;
+  bb_process_unsubscribe(p_bb, (bbMsg_Unsubscribe*)p_msg);
+}
+
+static void bb_handle_txtpacket(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  if(p_bb->txt_msg_handler != 0)
+    p_bb->txt_msg_handler(p_msg);
+}
+
+//Unpack each length-prefixed msg & dispatch it like it came in alone.
+//Senders never nest batches, so a batch inside a batch is dropped rather
+//than recursed into.
+static void bb_handle_batch(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  uint16_t entryLen;
+  uint16_t i = 0;
+
+  while(i + BB_BATCH_ENTRY_HDRLEN <= msgLen)
+    {
+      entryLen = (p_msg[i] << 8) | p_msg[i + 1];
+      i += BB_BATCH_ENTRY_HDRLEN;
+
+      if(entryLen > msgLen - i)
+	{
+	  BB_TRACE("Error: truncated batch entry\n");
+	  return;
+	}
+
+      if(entryLen > 0 && p_msg[i] == BB_BATCH)
+	BB_TRACE("Error: nested batch entry dropped\n");
+      else
+	bb_processMessage(p_bb, &(p_msg[i]), entryLen);
+      i += entryLen;
+    }
+}
+
+#if BB_MAX_NCOMMANDS > 0
+// Packed size of a command's args, -1 if a type is unknown or they
+// won't fit in BB_MAX_ARGSLEN
+static int16_t bb_command_argslen(const bbCommand* p_cmd)
+{
+  uint16_t argsLen = 0;
+  uint8_t i;
+
+  for(i = 0; i < p_cmd->nargs; i++)
+    {
+      if(bb_type_size(p_cmd->argTypes[i]) == 0) return -1;
+      argsLen += bb_type_size(p_cmd->argTypes[i]);
+    }
+
+  return (argsLen > BB_MAX_ARGSLEN) ? -1 : argsLen;
+}
+
+//Inner msg is | cmd_id | args |. Args were sized when the command was
+//registered (or, from a ROM table, are sized here), so decoding is a
+//length check & one copy into aligned memory.
+static void bb_handle_command(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  uint64_t args[(BB_MAX_ARGSLEN + 7) / 8];   //uint64_t keeps it aligned
+  const bbCommand* p_cmd;
+  uint16_t argsLen;
+
+  if(msgLen < 1 || p_msg[0] >= p_bb->ncommands) return;
+
+  p_cmd = &(p_bb->commands[p_msg[0]]);
+#ifdef BB_ROM_FIELDS
+  argsLen = bb_command_argslen(p_cmd);
+#else
+  argsLen = p_cmd->argsLen;
+#endif
+  if(msgLen - 1 != argsLen)
+    {
+      BB_TRACE("Error: command %d got %d arg bytes\n", p_msg[0], msgLen - 1);
+      return;
+    }
+
+  memcpy(args, &(p_msg[1]), argsLen);
+  p_cmd->p_cmdfcn(args);
+}
+#endif
+
+#if BB_MAX_NDEADBANDS > 0
+//Frees field's on-change slot in a deadband table, if it has one
+static void bb_deadband_clear(bbDeadband* p_dbs, uint8_t field_id)
+{
+  uint8_t i;
+
+  for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+    if(p_dbs[i].mode != BB_SUB_PERIODIC && p_dbs[i].field_id == field_id)
+      p_dbs[i].mode = BB_SUB_PERIODIC;
+}
+
+//Puts an on-change subscription in a deadband table, replacing any the
+//field had. Returns -1 if the table is full.
+static int8_t bb_deadband_add(bbDeadband* p_dbs, bbMsg_SubscribeOnChange* p_msg)
+{
+  uint8_t i;
+  bbDeadband* p_db;
+
+  bb_deadband_clear(p_dbs, p_msg->field_id);
+
+  for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+    if(p_dbs[i].mode == BB_SUB_PERIODIC) break;
+
+  if(i == BB_MAX_NDEADBANDS)
+    {
+      BB_TRACE("Error: no free deadband slot for field %d\n", p_msg->field_id);
+      return -1;
+    }
+
+  p_db = &(p_dbs[i]);
+  p_db->field_id = p_msg->field_id;
+  p_db->mode = p_msg->mode;
+  p_db->sent = 0;
+  p_db->threshold = p_msg->threshold;
+  p_db->min_interval = p_msg->min_interval;
+  p_db->max_interval = p_msg->max_interval;
+
+  return 0;
+}
+#endif
+
+void bb_process_subscribe(bbInstance* p_bb, bbMsg_Subscribe* p_msg)
+{
+  if(p_msg->field_id >= BB_MAX_NFIELDS) return;
+#if BB_MAX_NDEADBANDS > 0
+  bb_deadband_clear(p_bb->deadbands, p_msg->field_id);
+#endif
+  BB_MASK_SET(p_bb->subscriptions, p_msg->field_id);
+}
+
+void bb_process_unsubscribe(bbInstance* p_bb, bbMsg_Unsubscribe* p_msg)
+{
+  if(p_msg->field_id >= BB_MAX_NFIELDS) return;
+#if BB_MAX_NDEADBANDS > 0
+  bb_deadband_clear(p_bb->deadbands, p_msg->field_id);
+#endif
+  BB_MASK_CLR(p_bb->subscriptions, p_msg->field_id);
+}
+
+// Moves a field to on-change emission, replacing any earlier subscription.
+// A periodic mode, or any mode if deadbands are compiled out
+// (BB_MAX_NDEADBANDS 0), makes it a plain subscribe.
+void bb_process_subscribe_onchange(bbInstance* p_bb, bbMsg_SubscribeOnChange* p_msg)
+{
+#if BB_MAX_NDEADBANDS > 0
+  if(p_msg->mode == BB_SUB_PERIODIC || p_msg->mode > BB_SUB_DEADBAND_PCT)
+    {
+      bb_process_subscribe(p_bb, (bbMsg_Subscribe*)p_msg);
+      return;
+    }
+
+  if(p_msg->field_id >= p_bb->nfields) return;
+
+  if(bb_deadband_add(p_bb->deadbands, p_msg) == 0)
+    BB_MASK_CLR(p_bb->subscriptions, p_msg->field_id);
+#else
+  bb_process_subscribe(p_bb, (bbMsg_Subscribe*)p_msg);
+#endif
+}
+
+
+#ifdef BB_ROM_FIELDS
+// Points the instance at the application's const field table. Field ids
+// are table indices. Returns -1 if table is bigger than BB_MAX_NFIELDS.
+int8_t bb_register_fields(bbInstance* p_bb, const bbField* p_table, uint8_t nfields)
+{
+  if(nfields > BB_MAX_NFIELDS) return -1;
+
+  p_bb->fields = p_table;
+  p_bb->nfields = nfields;
+  return 0;
+}
+#else
+void bb_register_field(bbInstance* p_bb, void* p_var, enum Datatype type, char* p_name)
+{
+  bbField* p_field;
+
+  if(p_bb->nfields >= BB_MAX_NFIELDS) return;
+
+  p_field = &(p_bb->fields[p_bb->nfields]);
+
+  p_field->p_var = p_var;
+  p_field->type = type;
+  strncpy(p_field->name, p_name, BB_MAX_VARNAMELEN - 1);
+  p_field->name[BB_MAX_VARNAMELEN - 1] = 0;
+
+  p_bb->nfields += 1;
+}
+#endif
+
+// Returns msg length, -1 if no out buffer is set, -2 if it's busy (the
+// handshake isn't sent & connection state is unchanged, so retry).
+int8_t bb_send_handshake(bbInstance* p_bb)
+{
+  uint8_t* p_buf;
+
+  if(p_bb->p_out_msgbuf == 0) return -1;
+
+  p_buf = bb_out_begin(p_bb, 1);
+  if(p_buf == 0) return -2;   //No room until waiting bytes are sent
+
+  *p_buf = BB_HANDSHAKE_INIT;
+
+  bb_out_commit(p_bb, 1);
+  p_bb->connection_state = BB_HANDSHAKE_SENT;
+  return 1;
+}
+
+// Sends a BB_PUBLISH for one of the instance's fields. Returns msg
+// length, -1 if no out buffer or p_field isn't one of ours, -2 if busy.
+int8_t bb_publish_field(bbInstance* p_bb, const bbField* p_field)
+{
+  uint8_t* p_buf;
+  uint16_t nbytes;
+
+  //If no outgoing buffer has been set, raise error
+  if(p_bb->p_out_msgbuf == 0) return -1;
+
+  //Field id goes in the msg, so it has to be a registered field
+  if(p_field < &(p_bb->fields[0]) || p_field >= &(p_bb->fields[p_bb->nfields]))
+    return -1;
+
+  nbytes = BB_PUBLISH_MSGLEN;
+
+  p_buf = bb_out_begin(p_bb, nbytes);
+  if(p_buf == 0) return -2;   //No room until waiting bytes are sent
+
+  bb_make_publish(p_field, p_field - &(p_bb->fields[0]), p_buf);
+
+  BB_TRACE("\nnbytes: %d\n", nbytes);
+
+  bb_out_commit(p_bb, nbytes);
+  return nbytes;
+}
+
+
+// Writes the BB_PUBLISH msg describing a field into p_out, which must
+// hold BB_PUBLISH_MSGLEN bytes. Returns msg length.
+uint16_t bb_make_publish(const bbField* p_field, uint8_t field_id, uint8_t* p_out)
+{
+  enum Datatype type;
+  const char* p_name;
+  uint8_t* p_cur;
+  size_t len;
+
+  type = p_field->type;
+#ifdef BB_ROM_FIELDS
+  p_name = p_field->p_name;
+#else
+  p_name = p_field->name;
+#endif
+
+  p_cur = p_out;
+  *p_cur = BB_PUBLISH;             //Add BB message type
+  p_cur += 1;
+  *p_cur = field_id;               //Host indexes its catalog by this
+  p_cur += 1;
+
+  //Add field description, laid out like the packed RAM bbField
+  memcpy(p_cur, &(p_field->p_var), sizeof(void*));
+  p_cur += sizeof(void*);
+  memcpy(p_cur, &type, sizeof(enum Datatype));
+  p_cur += sizeof(enum Datatype);
+
+  len = strlen(p_name);
+  if(len > BB_MAX_VARNAMELEN - 1) len = BB_MAX_VARNAMELEN - 1;
+  memset(p_cur, 0, BB_MAX_VARNAMELEN);
+  memcpy(p_cur, p_name, len);
+
+  return BB_PUBLISH_MSGLEN;
+}
+
+// Writes the whole field catalog into p_out as one BB_BATCH msg of
+// BB_PUBLISH msgs, e.g. for a recording header. Returns msg length, or 0
+// if it won't fit in outLen.
+// Fields w/ a non-raw encoding also get a BB_ENCODING msg after the
+// publishes, and each command a BB_PUBLISH_COMMAND after those.
+uint16_t bb_make_catalog(bbInstance* p_bb, uint8_t* p_out, uint16_t outLen)
+{
+  uint8_t i;
+  uint16_t nbytes = 1;
+#if BB_MAX_NCOMMANDS > 0
+  uint16_t len;
+#endif
+  uint32_t needed;
+
+  needed = 1 + (uint32_t)p_bb->nfields * (BB_BATCH_ENTRY_HDRLEN + BB_PUBLISH_MSGLEN);
+  if(p_bb->encodings != 0)
+    needed += (uint32_t)p_bb->nfields * (BB_BATCH_ENTRY_HDRLEN + BB_ENCODING_MSGLEN);
+#if BB_MAX_NCOMMANDS > 0
+  for(i = 0; i < p_bb->ncommands; i++)
+    needed += BB_BATCH_ENTRY_HDRLEN + BB_PUBLISH_COMMAND_MSGLEN(p_bb->commands[i].nargs);
+#endif
+  if(needed > outLen) return 0;
+
+  p_out[0] = BB_BATCH;
+
+  for(i = 0; i < p_bb->nfields; i++)
+    {
+      p_out[nbytes]     = (BB_PUBLISH_MSGLEN >> 8) & 0x00ff;
+      p_out[nbytes + 1] = BB_PUBLISH_MSGLEN & 0x00ff;
+      nbytes += BB_BATCH_ENTRY_HDRLEN;
+
+      nbytes += bb_make_publish(&(p_bb->fields[i]), i, &(p_out[nbytes]));
+    }
+
+  for(i = 0; p_bb->encodings != 0 && i < p_bb->nfields; i++)
+    {
+      if(!bb_encoding_valid(p_bb->fields[i].type, &(p_bb->encodings[i]))) continue;
+
+      p_out[nbytes]     = (BB_ENCODING_MSGLEN >> 8) & 0x00ff;
+      p_out[nbytes + 1] = BB_ENCODING_MSGLEN & 0x00ff;
+      nbytes += BB_BATCH_ENTRY_HDRLEN;
+
+      nbytes += bb_make_encoding(p_bb, i, &(p_out[nbytes]));
+    }
+
+#if BB_MAX_NCOMMANDS > 0
+  for(i = 0; i < p_bb->ncommands; i++)
+    {
+      len = bb_make_command_publish(p_bb, i, &(p_out[nbytes + BB_BATCH_ENTRY_HDRLEN]));
+      p_out[nbytes]     = (len >> 8) & 0x00ff;
+      p_out[nbytes + 1] = len & 0x00ff;
+      nbytes += BB_BATCH_ENTRY_HDRLEN + len;
+    }
+#endif
+
+  return nbytes;
+}
+
+
+// Sets the per-field encoding table used by bb_send_tmpacked(). It must
+// have an entry for every registered field, and stay valid while in use,
+// so register fields first. Returns -1 (& keeps the old table) if an
+// entry doesn't suit its field's type, see bb_encoding_valid().
+int8_t bb_set_encodings(bbInstance* p_bb, const bbEncoding* p_table)
+{
+  uint8_t i;
+
+  for(i = 0; p_table != 0 && i < p_bb->nfields; i++)
+    if(p_table[i].kind != BB_ENC_RAW && !bb_encoding_valid(p_bb->fields[i].type, &(p_table[i])))
+      {
+	BB_TRACE("Error: bad encoding for field %d\n", i);
+	return -1;
+      }
+
+  p_bb->encodings = p_table;
+  return 0;
+}
+
+// Writes the BB_ENCODING msg for a field into p_out, which must hold
+// BB_ENCODING_MSGLEN bytes. Returns msg length.
+uint16_t bb_make_encoding(bbInstance* p_bb, uint8_t field_id, uint8_t* p_out)
+{
+  bbEncoding enc = { BB_ENC_RAW, 0, 1.0, 0.0 };
+
+  if(p_bb->encodings != 0 && field_id < p_bb->nfields)
+    enc = p_bb->encodings[field_id];
+
+  p_out[0] = BB_ENCODING;
+  p_out[1] = field_id;
+  p_out[2] = enc.kind;
+  p_out[3] = enc.nbits;
+  memcpy(&(p_out[4]), &(enc.scale), sizeof(float));
+  memcpy(&(p_out[4 + sizeof(float)]), &(enc.offset), sizeof(float));
+
+  return BB_ENCODING_MSGLEN;
+}
+
+// Registers a seqlock group. Returns its group id, or -1 if table is full.
+int8_t bb_register_group(bbInstance* p_bb, bbGroup* p_group)
+{
+  if(p_bb->ngroups >= BB_MAX_NGROUPS) return -1;
+
+  p_group->seq = 0;
+  p_bb->p_groups[p_bb->ngroups] = p_group;
+  p_bb->ngroups += 1;
+
+  return p_bb->ngroups - 1;
+}
+
+// Puts a field in a group (or w/ BB_NO_GROUP, takes it out) so it's
+// always sampled consistently w/ the rest of the group.
+int8_t bb_set_field_group(bbInstance* p_bb, uint8_t field_id, uint8_t group_id)
+{
+  if(field_id >= p_bb->nfields) return -1;
+  if(group_id != BB_NO_GROUP && group_id >= p_bb->ngroups) return -1;
+
+  p_bb->field_groups[field_id] = group_id;
+  return 0;
+}
+
+#if BB_MAX_NCOMMANDS > 0
+#ifdef BB_ROM_FIELDS
+// Points the instance at the application's const command table. Command
+// ids are table indices. Returns -1 (& keeps the old table) if it's
+// bigger than BB_MAX_NCOMMANDS or an entry couldn't be registered.
+int8_t bb_register_commands(bbInstance* p_bb, const bbCommand* p_table, uint8_t ncommands)
+{
+  uint8_t i;
+
+  if(ncommands > BB_MAX_NCOMMANDS) return -1;
+
+  for(i = 0; i < ncommands; i++)
+    if(p_table[i].nargs > BB_MAX_NARGS || p_table[i].p_cmdfcn == 0 ||
+       strlen(p_table[i].p_name) >= BB_MAX_VARNAMELEN ||
+       bb_command_argslen(&(p_table[i])) < 0)
+      return -1;
+
+  p_bb->commands = p_table;
+  p_bb->ncommands = ncommands;
+  return 0;
+}
+#else
+// Registers a command w/ its arg types. Returns the command id the
+// client uses in BB_COMMAND msgs, or -1 if it can't be registered.
+// p_name is kept, not copied.
+int8_t bb_register_command(bbInstance* p_bb, const char* p_name, void (*p_cmdfcn)(void* p_args),
+			   uint8_t nargs, enum Datatype* p_argTypes)
+{
+  bbCommand* p_cmd;
+  int16_t argsLen;
+  uint8_t i;
+
+  if(p_bb->ncommands >= BB_MAX_NCOMMANDS || nargs > BB_MAX_NARGS || p_cmdfcn == 0)
+    return -1;
+  if(strlen(p_name) >= BB_MAX_VARNAMELEN) return -1;
+
+  //Filled in the free slot, only counted once it checks out
+  p_cmd = &(p_bb->commands[p_bb->ncommands]);
+
+  p_cmd->p_name = p_name;
+  p_cmd->nargs = nargs;
+  for(i = 0; i < nargs; i++)
+    p_cmd->argTypes[i] = p_argTypes[i];
+  p_cmd->p_cmdfcn = p_cmdfcn;
+
+  argsLen = bb_command_argslen(p_cmd);
+  if(argsLen < 0) return -1;
+  p_cmd->argsLen = argsLen;
+
+  p_bb->ncommands += 1;
+  return p_bb->ncommands - 1;
+}
+#endif
+
+// Sends a BB_PUBLISH_COMMAND so the client learns a command's id & args.
+// Returns msg length, -1 if no out buffer or no such command, -2 if busy.
+int8_t bb_publish_command(bbInstance* p_bb, uint8_t cmd_id)
+{
+  uint8_t* p_buf;
+  uint16_t nbytes;
+
+  if(p_bb->p_out_msgbuf == 0 || cmd_id >= p_bb->ncommands) return -1;
+
+  nbytes = BB_PUBLISH_COMMAND_MSGLEN(p_bb->commands[cmd_id].nargs);
+
+  p_buf = bb_out_begin(p_bb, nbytes);
+  if(p_buf == 0) return -2;   //No room until waiting bytes are sent
+
+  bb_make_command_publish(p_bb, cmd_id, p_buf);
+
+  bb_out_commit(p_bb, nbytes);
+  return nbytes;
+}
+
+// Writes the BB_PUBLISH_COMMAND msg for a command into p_out, which must
+// hold BB_PUBLISH_COMMAND_MSGLEN(BB_MAX_NARGS) bytes. Returns msg length,
+// 0 if there's no such command.
+uint16_t bb_make_command_publish(bbInstance* p_bb, uint8_t cmd_id, uint8_t* p_out)
+{
+  const bbCommand* p_cmd;
+  size_t len;
+
+  if(cmd_id >= p_bb->ncommands) return 0;
+  p_cmd = &(p_bb->commands[cmd_id]);
+
+  p_out[0] = BB_PUBLISH_COMMAND;
+  p_out[1] = cmd_id;
+  p_out[2] = p_cmd->nargs;
+  memcpy(&(p_out[3]), p_cmd->argTypes, p_cmd->nargs);
+
+  len = strlen(p_cmd->p_name);
+  if(len > BB_MAX_VARNAMELEN - 1) len = BB_MAX_VARNAMELEN - 1;
+  memset(&(p_out[3 + p_cmd->nargs]), 0, BB_MAX_VARNAMELEN);
+  memcpy(&(p_out[3 + p_cmd->nargs]), p_cmd->p_name, len);
+
+  return BB_PUBLISH_COMMAND_MSGLEN(p_cmd->nargs);
+}
+#endif
+
+uint8_t bb_type_size(enum Datatype type)
+{
+  switch(type)
+    {
+    case INT8:
+    case UINT8:
+      return 1;
+
+    case INT16:
+    case UINT16:
+      return 2;
+
+    case INT32:
+    case UINT32:
+    case FLOAT32:
+      return 4;
+
+    case INT64:
+    case UINT64:
+    case FLOAT64:
+      return 8;
+
+    default:
+      return 0;
+    }
+}
+
+// Copies values of fields set in bitmap p_subs & in group_id into the entries
+// laid out by bb_sample().
+static void bb_sample_group(bbInstance* p_bb, uint8_t* p_subs, uint8_t group_id,
+			    uint8_t* p_out, uint16_t* p_offsets)
+{
+  uint8_t i;
+  const bbField* p_field;
+
+  for(i = 0; i < p_bb->nfields; i++)
+    {
+      if(!BB_MASK_GET(p_subs, i) || p_bb->field_groups[i] != group_id) continue;
+
+      p_field = &(p_bb->fields[i]);
+      memcpy(&(p_out[p_offsets[i] + 1]), p_field->p_var, bb_type_size(p_field->type));
+    }
+}
+
+// Writes a | field_id | value | entry for every field set in p_subs, in
+// field id order, noting where each one went in p_offsets. Grouped fields
+// are copied under their seqlock so a group is never mixed old & new.
+// Returns bytes written, or -3 if a group kept being written to.
+static int16_t bb_sample(bbInstance* p_bb, uint8_t* p_subs,
+			 uint8_t* p_out, uint16_t* p_offsets)
+{
+  uint8_t i;
+  uint8_t g;
+  uint8_t retries;
+  uint16_t nbytes = 0;
+  uint32_t seq_start;
+  uint32_t seq_end;
+  bbGroup* p_group;
+
+  //Lay out entries
+  for(i = 0; i < p_bb->nfields; i++)
+    {
+      if(!BB_MASK_GET(p_subs, i)) continue;
+
+      p_offsets[i] = nbytes;
+      p_out[nbytes] = i;
+      nbytes += 1 + bb_type_size(p_bb->fields[i].type);
+    }
+
+  for(g = 0; g < p_bb->ngroups; g++)
+    {
+      p_group = p_bb->p_groups[g];
+      retries = 0;
+
+      while(1)
+	{
+	  seq_start = p_group->seq;
+	  BB_BARRIER();
+	  bb_sample_group(p_bb, p_subs, g, p_out, p_offsets);
+	  BB_BARRIER();
+	  seq_end = p_group->seq;
+
+	  if(!(seq_start & 1) && seq_start == seq_end) break;  //Consistent copy
+
+	  if(++retries >= BB_SAMPLE_MAX_RETRIES)
+	    {
+	      BB_TRACE("bb_sample(): group %d kept changing\n", g);
+	      return -3;
+	    }
+	}
+    }
+
+  bb_sample_group(p_bb, p_subs, BB_NO_GROUP, p_out, p_offsets);
+  return nbytes;
+}
+
+// Sends one TM frame holding every subscribed field:
+//   | BB_TMPACKET | field_id | value | field_id | value | ...
+// Values are in native byte order, sized by type. Returns frame length,
+// -2 if out buffer is busy, -3 if a group kept being written during
+// sampling.
+int16_t bb_send_tmpacket(bbInstance* p_bb)
+{
+  uint8_t i;
+  uint16_t nbytes = 1;
+  uint16_t offsets[BB_MAX_NFIELDS];
+  uint8_t* p_buf;
+
+  for(i = 0; i < p_bb->nfields; i++)
+    if(BB_MASK_GET(p_bb->subscriptions, i))
+      nbytes += 1 + bb_type_size(p_bb->fields[i].type);
+
+  p_buf = bb_out_begin(p_bb, nbytes);
+  if(p_buf == 0) return -2;
+
+  *p_buf = BB_TMPACKET;
+  if(bb_sample(p_bb, p_bb->subscriptions, p_buf + 1, offsets) < 0) return -3;
+
+  bb_out_commit(p_bb, nbytes);
+  return nbytes;
+}
+
+
+static uint8_t bb_type_signed(uint8_t type)
+{
+  return (type == INT8 || type == INT16 || type == INT32 || type == INT64) ? 1 : 0;
+}
+
+//Reads a native value of any type as a double
+static double bb_value_to_double(uint8_t type, const uint8_t* p_val)
+{
+  union { int8_t i8; int16_t i16; int32_t i32; int64_t i64;
+	  uint8_t u8; uint16_t u16; uint32_t u32; uint64_t u64;
+	  float f32; double f64; } v;
+
+  memcpy(&v, p_val, bb_type_size(type));
+
+  switch(type)
+    {
+    case INT8:    return v.i8;
+    case INT16:   return v.i16;
+    case INT32:   return v.i32;
+    case INT64:   return (double)v.i64;
+    case UINT8:   return v.u8;
+    case UINT16:  return v.u16;
+    case UINT32:  return v.u32;
+    case UINT64:  return (double)v.u64;
+    case FLOAT32: return v.f32;
+    case FLOAT64: return v.f64;
+    default:      return 0;
+    }
+}
+
+//Reads a native integer value, sign-extended, as raw 64 bits
+static uint64_t bb_value_to_bits(uint8_t type, const uint8_t* p_val)
+{
+  int64_t sval;
+  uint64_t uval = 0;
+  uint8_t size;
+
+  size = bb_type_size(type);
+
+  if(bb_type_signed(type))
+    {
+      switch(size)
+	{
+	case 1: { int8_t x;  memcpy(&x, p_val, 1); sval = x; break; }
+	case 2: { int16_t x; memcpy(&x, p_val, 2); sval = x; break; }
+	case 4: { int32_t x; memcpy(&x, p_val, 4); sval = x; break; }
+	default:             memcpy(&sval, p_val, 8);
+	}
+      return (uint64_t)sval;
+    }
+
+  switch(size)
+    {
+    case 1: { uint8_t x;  memcpy(&x, p_val, 1); uval = x; break; }
+    case 2: { uint16_t x; memcpy(&x, p_val, 2); uval = x; break; }
+    case 4: { uint32_t x; memcpy(&x, p_val, 4); uval = x; break; }
+    default:              memcpy(&uval, p_val, 8);
+    }
+  return uval;
+}
+
+//Whether a field of this type can be sent w/ this (non-raw) encoding.
+//LINEAR is for floats, BITS for integers, and neither may take more bits
+//than the type has, which is what lets bb_send_tmpacked() pack in place.
+//Both ends check, so an unusable encoding just goes raw.
+static uint8_t bb_encoding_valid(uint8_t type, const bbEncoding* p_enc)
+{
+  if(p_enc->nbits == 0 || p_enc->nbits > 32 || p_enc->nbits > 8 * bb_type_size(type))
+    return 0;
+
+  switch(p_enc->kind)
+    {
+    case BB_ENC_LINEAR:
+      return ((type == FLOAT32 || type == FLOAT64) && p_enc->scale != 0) ? 1 : 0;
+
+    case BB_ENC_BITS:
+      return (type != FLOAT32 && type != FLOAT64) ? 1 : 0;
+
+    default:
+      return 0;
+    }
+}
+
+//Appends one value to a packed frame per its encoding
+static void bb_pack_value(bbBitWriter* p_w, uint8_t type, const bbEncoding* p_enc,
+			  const uint8_t* p_val)
+{
+  uint8_t i;
+  uint32_t maxRaw;
+  uint64_t bits;
+  int64_t maxSigned;
+  double scaled;
+
+  if(p_enc == 0 || !bb_encoding_valid(type, p_enc))
+    {
+      for(i = 0; i < bb_type_size(type); i++)
+	bb_bits_put(p_w, p_val[i], 8);
+      return;
+    }
+
+  maxRaw = (p_enc->nbits == 32) ? 0xffffffff : ((uint32_t)1 << p_enc->nbits) - 1;
+
+  //Integers that don't fit in nbits saturate rather than wrap
+  if(p_enc->kind == BB_ENC_BITS)
+    {
+      bits = bb_value_to_bits(type, p_val);
+      if(bb_type_signed(type))
+	{
+	  maxSigned = (int64_t)(maxRaw >> 1);
+	  if((int64_t)bits > maxSigned) bits = maxSigned;
+	  else if((int64_t)bits < -maxSigned - 1) bits = -maxSigned - 1;
+	}
+      else if(bits > maxRaw)
+	bits = maxRaw;
+
+      bb_bits_put(p_w, (uint32_t)bits, p_enc->nbits);
+      return;
+    }
+
+  //Linear quantization, rounded & clamped to the nbits range
+  scaled = (bb_value_to_double(type, p_val) - p_enc->offset) / p_enc->scale + 0.5;
+
+  if(!(scaled > 0)) bb_bits_put(p_w, 0, p_enc->nbits);   //Also catches NaN
+  else if(scaled >= maxRaw) bb_bits_put(p_w, maxRaw, p_enc->nbits);
+  else bb_bits_put(p_w, (uint32_t)scaled, p_enc->nbits);
+}
+
+// Sends one packed TM frame holding every subscribed field:
+//   | BB_TMPACKED | field mask | bitstream |
+// Mask has a bit per registered field (LSB first), the bitstream has
+// each included field in id order at its encoded width. Sampling is done
+// as for bb_send_tmpacket(), then packed in place. Returns frame length,
+// -2 if out buffer is busy, -3 if a group kept being written.
+int16_t bb_send_tmpacked(bbInstance* p_bb)
+{
+  uint8_t i;
+  uint8_t maskLen;
+  uint16_t rawLen = 0;
+  uint16_t offsets[BB_MAX_NFIELDS];
+  uint8_t* p_buf;
+  uint8_t* p_raw;
+  uint8_t value[8];
+  bbBitWriter w;
+
+  maskLen = (p_bb->nfields + 7) / 8;
+  for(i = 0; i < p_bb->nfields; i++)
+    if(BB_MASK_GET(p_bb->subscriptions, i))
+      rawLen += 1 + bb_type_size(p_bb->fields[i].type);
+
+  //Room for the unpacked sample, which is never smaller than the packed one
+  p_buf = bb_out_begin(p_bb, 1 + maskLen + rawLen);
+  if(p_buf == 0) return -2;
+
+  //Subscriptions are already a mask in the same layout, less any bits
+  //past nfields
+  p_buf[0] = BB_TMPACKED;
+  memcpy(&(p_buf[1]), p_bb->subscriptions, maskLen);
+  if(p_bb->nfields & 0x07)
+    p_buf[maskLen] &= (1 << (p_bb->nfields & 0x07)) - 1;
+
+  p_raw = &(p_buf[1 + maskLen]);
+  if(bb_sample(p_bb, p_bb->subscriptions, p_raw, offsets) < 0) return -3;
+
+  //Pack over the sample. Each value is copied out before the writer can
+  //reach it: bb_encoding_valid() never lets a value take more bits than
+  //its raw bytes, so packed bits never outrun the raw bytes read.
+  bb_bits_writer_init(&w, p_raw);
+  for(i = 0; i < p_bb->nfields; i++)
+    {
+      if(!BB_MASK_GET(p_bb->subscriptions, i)) continue;
+
+      memcpy(value, &(p_raw[offsets[i] + 1]), bb_type_size(p_bb->fields[i].type));
+      bb_pack_value(&w, p_bb->fields[i].type,
+		    (p_bb->encodings != 0) ? &(p_bb->encodings[i]) : 0, value);
+    }
+
+  rawLen = 1 + maskLen + bb_bits_flush(&w);
+  bb_out_commit(p_bb, rawLen);
+  return rawLen;
+}
+
+
+void bb_catalog_init(bbCatalog* p_cat)
+{
+  uint8_t i;
+
+  p_cat->nfields = 0;
+
+  for(i = 0; i < BB_MAX_NFIELDS; i++)
+    {
+      p_cat->types[i] = UNKNOWN;
+      p_cat->encodings[i].kind = BB_ENC_RAW;
+      p_cat->encodings[i].nbits = 0;
+    }
+
+#if BB_MAX_NCOMMANDS > 0
+  for(i = 0; i < BB_MAX_NCOMMANDS; i++)
+    p_cat->commands[i].nargs = 0xff;
+#endif
+}
+
+// Inner msg of a BB_PUBLISH. Entries are indexed by the field id in the
+// msg, so fields can be published singly, in any order, or again.
+// nfields covers the highest id seen; ids in between stay UNKNOWN.
+void bb_catalog_process_publish(bbCatalog* p_cat, uint8_t* p_msg, uint16_t msgLen)
+{
+  enum Datatype type;
+  uint8_t field_id;
+
+  //Type is found from the end, since p_var is the device's pointer size,
+  //which needn't match ours (e.g. 32-bit MCU, 64-bit host)
+  if(msgLen < 1 + BB_MAX_VARNAMELEN + sizeof(enum Datatype)) return;
+
+  field_id = p_msg[0];
+  if(field_id >= BB_MAX_NFIELDS) return;
+
+  memcpy(&type, &(p_msg[msgLen - BB_MAX_VARNAMELEN - sizeof(enum Datatype)]),
+	 sizeof(enum Datatype));
+
+  p_cat->types[field_id] = type;
+  p_cat->encodings[field_id].kind = BB_ENC_RAW;
+  p_cat->encodings[field_id].nbits = 0;
+  if(field_id >= p_cat->nfields) p_cat->nfields = field_id + 1;
+}
+
+// Inner msg of a BB_ENCODING
+void bb_catalog_process_encoding(bbCatalog* p_cat, uint8_t* p_msg, uint16_t msgLen)
+{
+  bbEncoding* p_enc;
+
+  if(msgLen < BB_ENCODING_MSGLEN - 1 || p_msg[0] >= BB_MAX_NFIELDS) return;
+
+  p_enc = &(p_cat->encodings[p_msg[0]]);
+  p_enc->kind = p_msg[1];
+  p_enc->nbits = p_msg[2];
+  memcpy(&(p_enc->scale), &(p_msg[3]), sizeof(float));
+  memcpy(&(p_enc->offset), &(p_msg[3 + sizeof(float)]), sizeof(float));
+}
+
+#if BB_MAX_NCOMMANDS > 0
+// Inner msg of a BB_PUBLISH_COMMAND
+void bb_catalog_process_command(bbCatalog* p_cat, uint8_t* p_msg, uint16_t msgLen)
+{
+  bbCommandInfo* p_info;
+  uint8_t nargs;
+
+  if(msgLen < 2 || p_msg[0] >= BB_MAX_NCOMMANDS) return;
 
-void bb_init(bbInstance* p_bb, uint8_t* p_buf, uint16_t buflen)
+  nargs = p_msg[1];
+  if(nargs > BB_MAX_NARGS || msgLen != BB_PUBLISH_COMMAND_MSGLEN(nargs) - 1) return;
+
+  p_info = &(p_cat->commands[p_msg[0]]);
+  p_info->nargs = nargs;
+  memcpy(p_info->argTypes, &(p_msg[2]), nargs);
+  memcpy(p_info->name, &(p_msg[2 + nargs]), BB_MAX_VARNAMELEN);
+  p_info->name[BB_MAX_VARNAMELEN - 1] = 0;
+}
+
+// Returns id of the published command w/ this name, or -1 if none
+int8_t bb_catalog_find_command(bbCatalog* p_cat, const char* p_name)
 {
-  uint8_t i = 0;
-  bbField* p_field;
+  uint8_t i;
 
-  p_bb->nfields = 0; //Reset number of registered fields to zero
+  for(i = 0; i < BB_MAX_NCOMMANDS; i++)
+    if(p_cat->commands[i].nargs != 0xff &&
+       strncmp(p_cat->commands[i].name, p_name, BB_MAX_VARNAMELEN) == 0)
+      return i;
 
-  p_bb->p_out_msgbuf = p_buf;
-  p_bb->out_msgbuf_len = buflen;
-  p_bb->out_bytes_waiting = 0;
+  return -1;
+}
+#endif
 
-  //Clear all fields & subscriptions
-  for(i = 0; i < BB_MAX_NFIELDS; i++)
+// Decodes inner msg of a BB_TMPACKED, calling p_value w/ each field's
+// value. Returns number of values, or -1 if frame doesn't match catalog.
+int16_t bb_decode_tmpacked(bbCatalog* p_cat, uint8_t* p_msg, uint16_t msgLen,
+			   void (*p_value)(void* p_ctx, uint8_t field_id, double value),
+			   void* p_ctx)
+{
+  uint8_t i, j;
+  uint8_t maskLen;
+  uint8_t size;
+  uint8_t value[8];
+  uint32_t raw;
+  int64_t sraw;
+  int16_t count = 0;
+  bbEncoding* p_enc;
+  bbBitReader r;
+
+  maskLen = (p_cat->nfields + 7) / 8;
+  if(msgLen < maskLen) return -1;
+
+  bb_bits_reader_init(&r, &(p_msg[maskLen]), msgLen - maskLen);
+
+  for(i = 0; i < p_cat->nfields; i++)
     {
-      p_field = &(p_bb->fields[i]);  //Clear field
-      p_field->p_var = 0;
-      p_field->type = UNKNOWN;
-      p_field->name[0] = 0;  //Null the string
+      if(!(p_msg[i >> 3] & (1 << (i & 0x07)))) continue;
+
+      p_enc = &(p_cat->encodings[i]);
+      size = bb_type_size(p_cat->types[i]);
+      if(size == 0) return -1;   //Field never published
+
+      if(!bb_encoding_valid(p_cat->types[i], p_enc))
+	{
+	  for(j = 0; j < size; j++)
+	    {
+	      if(!bb_bits_get(&r, 8, &raw)) return -1;
+	      value[j] = raw;
+	    }
+	  p_value(p_ctx, i, bb_value_to_double(p_cat->types[i], value));
+	}
+      else
+	{
+	  if(!bb_bits_get(&r, p_enc->nbits, &raw)) return -1;
+
+	  if(p_enc->kind == BB_ENC_LINEAR)
+	    p_value(p_ctx, i, raw * (double)p_enc->scale + p_enc->offset);
+	  else if(bb_type_signed(p_cat->types[i]) && p_enc->nbits < 32 &&
+		  (raw & ((uint32_t)1 << (p_enc->nbits - 1))))
+	    {
+	      sraw = (int64_t)raw - ((int64_t)1 << p_enc->nbits);  //Sign-extend
+	      p_value(p_ctx, i, (double)sraw);
+	    }
+	  else if(bb_type_signed(p_cat->types[i]))
+	    p_value(p_ctx, i, (double)(int32_t)raw);
+	  else
+	    p_value(p_ctx, i, raw);
+	}
+
+      count += 1;
+    }
+
+  return count;
+}
+
+#if BB_MAX_NDEADBANDS > 0
+//Whether an on-change field w/ this value is due to be sent
+static uint8_t bb_deadband_due(bbDeadband* p_db, uint8_t type, const void* p_val, uint32_t now)
+{
+  double value;
+  double delta;
+  double band;
+
+  if(!p_db->sent) return 1;
+
+  if(now - p_db->last_time < p_db->min_interval) return 0;
+  if(p_db->max_interval > 0 && now - p_db->last_time >= p_db->max_interval) return 1;
+
+  value = bb_value_to_double(type, p_val);
+
+  delta = value - p_db->last_value;
+  if(delta < 0) delta = -delta;
+
+  band = p_db->threshold;
+  if(p_db->mode == BB_SUB_DEADBAND_PCT)
+    band *= ((p_db->last_value < 0) ? -p_db->last_value : p_db->last_value) / 100.0;
+
+  return (delta > band) ? 1 : 0;
+}
 
-      p_bb->subscriptions[i] = 0;    //Clear subscription
+// Call every tick w/ the current time. Checks each on-change field against
+// its deadband & intervals, and sends every one that's due in a single
+// BB_TMPACKET frame (same format as bb_send_tmpacket()). Returns frame
+// length, 0 if nothing was due, -2 if out buffer is busy, -3 if a group
+// kept being written. On error nothing is marked sent, so it's retried.
+int16_t bb_poll_deadbands(bbInstance* p_bb, uint32_t now)
+{
+  uint8_t i;
+  uint8_t due[BB_FIELD_MASKLEN];
+  uint8_t ndue = 0;
+  uint16_t nbytes = 1;
+  uint16_t offsets[BB_MAX_NFIELDS];
+  uint8_t* p_buf;
+  bbDeadband* p_db;
+  const bbField* p_field;
+
+  memset(due, 0, sizeof(due));
+
+  for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+    {
+      p_db = &(p_bb->deadbands[i]);
+      if(p_db->mode == BB_SUB_PERIODIC) continue;
+
+      //Unlocked read, only used to decide. What's sent is sampled properly.
+      p_field = &(p_bb->fields[p_db->field_id]);
+      if(!bb_deadband_due(p_db, p_field->type, p_field->p_var, now)) continue;
+
+      BB_MASK_SET(due, p_db->field_id);
+      nbytes += 1 + bb_type_size(p_bb->fields[p_db->field_id].type);
+      ndue += 1;
     }
+
+  if(ndue == 0) return 0;
+
+  p_buf = bb_out_begin(p_bb, nbytes);
+  if(p_buf == 0) return -2;
+
+  *p_buf = BB_TMPACKET;
+  if(bb_sample(p_bb, due, p_buf + 1, offsets) < 0) return -3;
+
+  //Deadbands are measured from what was actually sent
+  for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+    {
+      p_db = &(p_bb->deadbands[i]);
+      if(p_db->mode == BB_SUB_PERIODIC || !BB_MASK_GET(due, p_db->field_id)) continue;
+
+      p_db->last_value = bb_value_to_double(p_bb->fields[p_db->field_id].type,
+					    &(p_buf[1 + offsets[p_db->field_id] + 1]));
+      p_db->last_time = now;
+      p_db->sent = 1;
+    }
+
+  bb_out_commit(p_bb, nbytes);
+  return nbytes;
 }
+#endif
 
+// Writes a full BB_SUBSCRIBE packet (incl. type byte) asking for on-change
+// emission of a field. p_out must hold 1 + sizeof(bbMsg_SubscribeOnChange)
+// bytes. Returns packet length.
+uint16_t bb_make_subscribe_onchange(uint8_t* p_out, uint8_t field_id, uint8_t mode,
+				    float threshold, uint32_t min_interval,
+				    uint32_t max_interval)
+{
+  bbMsg_SubscribeOnChange msg;
 
-void bb_processMessage(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+  msg.field_id = field_id;
+  msg.mode = mode;
+  msg.threshold = threshold;
+  msg.min_interval = min_interval;
+  msg.max_interval = max_interval;
+
+  p_out[0] = BB_SUBSCRIBE;
+  memcpy(&(p_out[1]), &msg, sizeof(msg));
+
+  return 1 + sizeof(msg);
+}
+
+void bb_client_init(bbClient* p_client)
 {
+#if BB_MAX_NDEADBANDS > 0
   uint8_t i;
-  uint8_t msgType;
-  uint8_t* p_innerMsg;
-  uint16_t innerMsgLen;
+#endif
 
-  printf("Message received: \"");
-  for (i = 0; i < msgLen; ++i)
-    printf("%c", p_msg[i]);
-  printf("\"\n");
- 
-  //Arrange inner message and inner message length
-  msgType = p_msg[0];
-  p_innerMsg = &(p_msg[1]);
-  innerMsgLen = msgLen - 1;
+  memset(p_client->subscriptions, 0, BB_FIELD_MASKLEN);
 
-  switch(msgType)
+#if BB_MAX_NDEADBANDS > 0
+  for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+    p_client->deadbands[i].mode = BB_SUB_PERIODIC;
+#endif
+
+  p_client->connection_state = BB_NO_CONNECTION;
+}
+
+// Handles a msg that came in from one client of a multi-client instance.
+// Connection & subscription msgs (incl. on-change ones) update that
+// client, the rest go through bb_processMessage() as usual.
+void bb_client_processMessage(bbInstance* p_bb, bbClient* p_client,
+			      uint8_t* p_msg, uint16_t msgLen)
+{
+#if BB_MAX_NDEADBANDS > 0
+  bbMsg_SubscribeOnChange* p_onchange;
+#endif
+
+  if(msgLen == 0) return;
+
+  switch(p_msg[0])
     {
     case BB_HANDSHAKE_INIT:
-      p_bb->connection_state = BB_CONNECTED;
+      p_client->connection_state = BB_CONNECTED;
       break;
 
     case BB_ACK:
-      if(p_bb->connection_state == BB_HANDSHAKE_SENT)
-	p_bb->connection_state = BB_CONNECTED;
+      if(p_client->connection_state == BB_HANDSHAKE_SENT)
+	p_client->connection_state = BB_CONNECTED;
       break;
 
-    case BB_REQUEST_AVAILABLE_FIELDS:
+    case BB_SUBSCRIBE:
+    case BB_UNSUBSCRIBE:
+      if(msgLen < 2 || p_msg[1] >= BB_MAX_NFIELDS) return;
+
+#if BB_MAX_NDEADBANDS > 0
+      p_onchange = (bbMsg_SubscribeOnChange*)&(p_msg[1]);
+      if(p_msg[0] == BB_SUBSCRIBE && msgLen >= 1 + sizeof(bbMsg_SubscribeOnChange) &&
+	 (p_onchange->mode == BB_SUB_DEADBAND_ABS || p_onchange->mode == BB_SUB_DEADBAND_PCT))
+	{
+	  if(p_msg[1] < p_bb->nfields && bb_deadband_add(p_client->deadbands, p_onchange) == 0)
+	    BB_MASK_CLR(p_client->subscriptions, p_msg[1]);
+	  return;
+	}
+
+      bb_deadband_clear(p_client->deadbands, p_msg[1]);
+#endif
+      if(p_msg[0] == BB_SUBSCRIBE)
+	BB_MASK_SET(p_client->subscriptions, p_msg[1]);
+      else
+	BB_MASK_CLR(p_client->subscriptions, p_msg[1]);
       break;
 
-    case BB_PUBLISH:
-      printf("Publish message received.\n");
-      break;
+    default:
+      bb_processMessage(p_bb, p_msg, msgLen);
+    }
+}
 
-    case BB_SUBSCRIBE:
-      bb_process_subscribe(p_bb, (bbMsg_Subscribe*)p_innerMsg);
-      break;
+void bb_fanout_init(bbFanout* p_fan, bbClient* p_clients, uint8_t nclients)
+{
+  p_fan->p_clients = p_clients;
+  p_fan->nclients = nclients;
+  p_fan->encoded_len = 0;
+  p_fan->valid = 0;
 
-    case BB_UNSUBSCRIBE:
-      bb_process_unsubscribe(p_bb, (bbMsg_Unsubscribe*)p_innerMsg);
-      break;
+  memset(p_fan->encoded_mask, 0, BB_FIELD_MASKLEN);
+}
 
-    case BB_TMPACKET:
-      bb_process_tmpacket(p_bb, (bbMsg_TM*)p_innerMsg);
-      break;
+// Samples & encodes, once, every field any client is subscribed to,
+// periodic or on-change. Call once per tick, then bb_fanout_frame() &
+// bb_fanout_deadbands() for each client. Returns encoded bytes, or -3 if a
+// group kept being written during sampling, in which case no frames can be
+// built until a sample succeeds.
+int16_t bb_fanout_sample(bbInstance* p_bb, bbFanout* p_fan)
+{
+  uint8_t i;
+  uint8_t c;
+  int16_t nbytes;
+#if BB_MAX_NDEADBANDS > 0
+  bbClient* p_client;
+#endif
 
-    case BB_TXTPACKET:
-      p_bb->txt_msg_handler(p_innerMsg);
-      break;
+  //Bitmaps, so this is 8 fields a byte
+  for(i = 0; i < BB_FIELD_MASKLEN; i++)
+    {
+      p_fan->encoded_mask[i] = 0;
+      for(c = 0; c < p_fan->nclients; c++)
+	p_fan->encoded_mask[i] |= p_fan->p_clients[c].subscriptions[i];
+    }
 
-    default:
-      printf("Error: unknown packet type\n");
+#if BB_MAX_NDEADBANDS > 0
+  for(c = 0; c < p_fan->nclients; c++)
+    {
+      p_client = &(p_fan->p_clients[c]);
+      for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+	if(p_client->deadbands[i].mode != BB_SUB_PERIODIC)
+	  BB_MASK_SET(p_fan->encoded_mask, p_client->deadbands[i].field_id);
     }
+#endif
 
+  nbytes = bb_sample(p_bb, p_fan->encoded_mask, p_fan->encoded, p_fan->offsets);
+  p_fan->encoded_len = (nbytes < 0) ? 0 : nbytes;
+  p_fan->valid = (nbytes < 0) ? 0 : 1;
+
+  return nbytes;
 }
 
-void bb_process_tmpacket(bbInstance* p_bb, bbMsg_TM* p_msg)
+//Builds a TM frame of the fields set in bitmap p_fields as segments pointing into
+//the shared encoding, merging neighboring entries
+static int16_t bb_fanout_segments(bbInstance* p_bb, bbFanout* p_fan, uint8_t* p_fields,
+				  bbSegment* p_segs, uint8_t maxSegs)
 {
+  static const uint8_t tm_header = BB_TMPACKET;
+  const uint8_t* p_entry;
+  uint8_t nsegs = 1;
+  uint8_t i;
+  uint8_t len;
+
+  if(!p_fan->valid) return -3;
+  if(maxSegs == 0) return 0;
+
+  p_segs[0].p_data = &tm_header;
+  p_segs[0].len = 1;
+
+  for(i = 0; i < p_bb->nfields; i++)
+    {
+      if(!BB_MASK_GET(p_fields, i) || !BB_MASK_GET(p_fan->encoded_mask, i)) continue;
+
+      p_entry = &(p_fan->encoded[p_fan->offsets[i]]);
+      len = 1 + bb_type_size(p_bb->fields[i].type);
+
+      //Extend last segment if this entry follows right after it
+      if(nsegs > 1 && p_segs[nsegs - 1].p_data + p_segs[nsegs - 1].len == p_entry)
+	{
+	  p_segs[nsegs - 1].len += len;
+	  continue;
+	}
+
+      if(nsegs >= maxSegs) return 0;
+
+      p_segs[nsegs].p_data = p_entry;
+      p_segs[nsegs].len = len;
+      nsegs += 1;
+    }
+
+  return nsegs;
 }
 
-void bb_process_subscribe(bbInstance* p_bb, bbMsg_Subscribe* p_msg)
+// Builds a client's TM frame of its periodic fields as a list of segments
+// pointing into the shared encoding. Send the segments in order (or
+// gather them w/ bb_segments_copy()). Returns number of segments, 0 if
+// they won't fit in maxSegs, -3 if the last bb_fanout_sample() failed.
+int16_t bb_fanout_frame(bbInstance* p_bb, bbFanout* p_fan, bbClient* p_client,
+			bbSegment* p_segs, uint8_t maxSegs)
 {
-  p_bb->subscriptions[p_msg->field_id] = 1;
+  return bb_fanout_segments(p_bb, p_fan, p_client->subscriptions, p_segs, maxSegs);
 }
 
-void bb_process_unsubscribe(bbInstance* p_bb, bbMsg_Unsubscribe* p_msg)
+#if BB_MAX_NDEADBANDS > 0
+// Builds a client's frame of on-change fields that are due, as
+// bb_poll_deadbands() does for a single client but from the shared
+// sample. Fields in it are marked sent. Returns number of segments, 0 if
+// nothing's due or it won't fit in maxSegs, -3 if the last
+// bb_fanout_sample() failed.
+int16_t bb_fanout_deadbands(bbInstance* p_bb, bbFanout* p_fan, bbClient* p_client,
+			    uint32_t now, bbSegment* p_segs, uint8_t maxSegs)
 {
-  p_bb->subscriptions[p_msg->field_id] = 0;
+  uint8_t i;
+  uint8_t due[BB_FIELD_MASKLEN];
+  uint8_t ndue = 0;
+  int16_t nsegs;
+  bbDeadband* p_db;
+
+  if(!p_fan->valid) return -3;
+
+  memset(due, 0, sizeof(due));
+
+  for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+    {
+      p_db = &(p_client->deadbands[i]);
+      if(p_db->mode == BB_SUB_PERIODIC || !BB_MASK_GET(p_fan->encoded_mask, p_db->field_id)) continue;
+
+      if(!bb_deadband_due(p_db, p_bb->fields[p_db->field_id].type,
+			  &(p_fan->encoded[p_fan->offsets[p_db->field_id] + 1]), now))
+	continue;
+
+      BB_MASK_SET(due, p_db->field_id);
+      ndue += 1;
+    }
+
+  if(ndue == 0) return 0;
+
+  nsegs = bb_fanout_segments(p_bb, p_fan, due, p_segs, maxSegs);
+  if(nsegs <= 0) return nsegs;
+
+  for(i = 0; i < BB_MAX_NDEADBANDS; i++)
+    {
+      p_db = &(p_client->deadbands[i]);
+      if(p_db->mode == BB_SUB_PERIODIC || !BB_MASK_GET(due, p_db->field_id)) continue;
+
+      p_db->last_value = bb_value_to_double(p_bb->fields[p_db->field_id].type,
+					    &(p_fan->encoded[p_fan->offsets[p_db->field_id] + 1]));
+      p_db->last_time = now;
+      p_db->sent = 1;
+    }
+
+  return nsegs;
 }
+#endif
 
+// Gathers segments into one contiguous buffer. Returns bytes copied,
+// 0 if they won't fit.
+uint16_t bb_segments_copy(bbSegment* p_segs, uint8_t nsegs, uint8_t* p_out, uint16_t outLen)
+{
+  uint8_t i;
+  uint16_t nbytes = 0;
 
-void bb_register_field(bbInstance* p_bb, void* p_var, enum Datatype type, char* p_name)
+  for(i = 0; i < nsegs; i++)
+    {
+      if(nbytes + p_segs[i].len > outLen) return 0;
+
+      memcpy(&(p_out[nbytes]), p_segs[i].p_data, p_segs[i].len);
+      nbytes += p_segs[i].len;
+    }
+
+  return nbytes;
+}
+
+
+// Turns batching on (max_bytes > 0) or off (max_bytes = 0). A batch goes
+// out once another msg won't fit in max_bytes (or the out buffer), or
+// max_delay after bb_poll_batch() first sees it.
+void bb_set_batching(bbInstance* p_bb, uint16_t max_bytes, uint32_t max_delay)
 {
-  uint8_t field_id;
-  bbField* p_field;
+  bb_flush(p_bb);
 
-  p_field = &(p_bb->fields[p_bb->nfields]);
+  p_bb->batch_max_bytes = max_bytes;
+  p_bb->batch_max_delay = max_delay;
+}
 
-  p_field->p_var = p_var;
-  p_field->type = type;
-  strcpy(p_field->name, p_name);
+// Call periodically w/ the current time to enforce the latency budget
+void bb_poll_batch(bbInstance* p_bb, uint32_t now)
+{
+  if(p_bb->batch_len == 0) return;
 
-  p_bb->nfields += 1;
+  if(!p_bb->batch_timing)
+    {
+      p_bb->batch_timing = 1;
+      p_bb->batch_start = now;
+    }
+
+  if(now - p_bb->batch_start >= p_bb->batch_max_delay)
+    bb_flush(p_bb);
 }
 
-void bb_send_handshake(bbInstance* p_bb)
+// Hands the open batch to the user through out_bytes_waiting. A batch
+// holding a single msg is unwrapped so it doesn't pay the batch overhead.
+void bb_flush(bbInstance* p_bb)
 {
   uint8_t* p_buf;
+  uint16_t len;
+
+  if(p_bb->batch_len == 0) return;
+
+  if(p_bb->batch_nmsgs == 0)   //Batch opened but nothing committed to it
+    {
+      p_bb->batch_len = 0;
+      p_bb->batch_timing = 0;
+      return;
+    }
 
   p_buf = p_bb->p_out_msgbuf;
 
-  *p_buf = BB_HANDSHAKE_INIT;
+  if(p_bb->batch_nmsgs == 1)
+    {
+      len = p_bb->batch_len - 1 - BB_BATCH_ENTRY_HDRLEN;
+      memmove(p_buf, &(p_buf[1 + BB_BATCH_ENTRY_HDRLEN]), len);
+      p_bb->out_bytes_waiting = len;
+    }
+  else
+    p_bb->out_bytes_waiting = p_bb->batch_len;
 
-  p_bb->out_bytes_waiting = 1;
-  p_bb->connection_state = BB_HANDSHAKE_SENT;
+  p_bb->batch_len = 0;
+  p_bb->batch_nmsgs = 0;
+  p_bb->batch_timing = 0;
 }
 
-int8_t bb_publish_field(bbInstance* p_bb, bbField* p_field)
+
+// Returns where an outgoing msg of msgLen bytes should be written, or 0 if
+// there's no room until the user drains out_bytes_waiting.
+static uint8_t* bb_out_begin(bbInstance* p_bb, uint16_t msgLen)
 {
-  uint8_t i;
   uint8_t* p_buf;
-  uint8_t* p_buf_end;
-  uint8_t* p_cur;
+  uint16_t cap;
 
-  uint16_t nbytes;
+  p_buf = p_bb->p_out_msgbuf;
+  if(p_buf == 0 || msgLen > p_bb->out_msgbuf_len) return 0;
 
-  //If no outgoing buffer has been set, raise error
-  if(p_bb->p_out_msgbuf == 0) return -1;
+  if(p_bb->out_bytes_waiting > 0) return 0;  //Last msg/batch not sent yet
 
-  if(p_bb->out_bytes_waiting > 0)
-    printf("bb_publish_field(): Error, out_bytes_waiting = %d", 
-	   p_bb->out_bytes_waiting);
+  if(p_bb->batch_max_bytes == 0) return p_buf;  //Not batching, msg goes straight out
 
-  p_buf = p_bb->p_out_msgbuf;
-  p_cur = p_buf;
+  cap = p_bb->batch_max_bytes;
+  if(cap > p_bb->out_msgbuf_len) cap = p_bb->out_msgbuf_len;
 
-  *p_cur = BB_PUBLISH;             //Add BB message type
-  p_cur += 1;
-  
-  //Add field struct to outgoing buff
-  memcpy(p_cur, p_field, sizeof(bbField));
+  if(p_bb->batch_len == 0)
+    {
+      //Too big to batch, send it on its own
+      if(1 + BB_BATCH_ENTRY_HDRLEN + msgLen > cap) return p_buf;
+
+      p_buf[0] = BB_BATCH;
+      p_bb->batch_len = 1;
+    }
+  else if(p_bb->batch_len + BB_BATCH_ENTRY_HDRLEN + msgLen > cap)
+    {
+      bb_flush(p_bb);   //Batch is full, send it & make caller retry
+      return 0;
+    }
 
-  nbytes = 1 + sizeof(*p_field);
-  printf("\nnbytes: %d\n", nbytes);
+  return &(p_buf[p_bb->batch_len + BB_BATCH_ENTRY_HDRLEN]);
+}
 
-  p_bb->out_bytes_waiting = nbytes;
-  return nbytes;
+static void bb_out_commit(bbInstance* p_bb, uint16_t msgLen)
+{
+  uint8_t* p_entry;
+
+  if(p_bb->batch_max_bytes == 0 || p_bb->batch_len == 0)
+    {
+      p_bb->out_bytes_waiting = msgLen;
+      return;
+    }
+
+  //Fill in entry length in front of msg
+  p_entry = &(p_bb->p_out_msgbuf[p_bb->batch_len]);
+  p_entry[0] = (msgLen >> 8) & 0x00ff;
+  p_entry[1] = msgLen & 0x00ff;
+
+  p_bb->batch_len += BB_BATCH_ENTRY_HDRLEN + msgLen;
+  p_bb->batch_nmsgs += 1;
+
+  //Send it now if nothing else could fit
+  if(p_bb->batch_len + BB_BATCH_ENTRY_HDRLEN >= p_bb->batch_max_bytes ||
+     p_bb->batch_len + BB_BATCH_ENTRY_HDRLEN >= p_bb->out_msgbuf_len)
+    bb_flush(p_bb);
 }
 
 
@@ -204,41 +1629,168 @@ int8_t bb_publish_field(bbInstance* p_bb, bbField* p_field)
 
 #ifdef UNIT_TEST
 
+#if BB_MAX_MSGTYPES == 0
+#error "Unit test registers msg handlers, build it w/ BB_MAX_MSGTYPES > 0"
+#endif
+
+#include <time.h>  //Needed to time command dispatch
+
 void print_fields(bbInstance* p_bb)
 {
   int i;
-  bbField* p_field;
+  const bbField* p_field;
 
   printf("\nRegistered fields:\n");
   for(i = 0; i < p_bb->nfields; i++)
     {
       p_field = &(p_bb->fields[i]);
+#ifdef BB_ROM_FIELDS
+	printf("p_var: %p \t type: %d \t name: %s\n", 
+	      p_field->p_var, p_field->type, p_field->p_name);
+#else
 	printf("p_var: %p \t type: %d \t name: %s\n", 
 	      p_field->p_var, p_field->type, p_field->name);
+#endif
     }
 }
 
 
+void print_publish(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  printf("Publish message received.\n");
+}
+
+
+bbCatalog hostCatalog;
+
+void catalog_publish(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  bb_catalog_process_publish(&hostCatalog, p_msg, msgLen);
+}
+
+void catalog_encoding(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  bb_catalog_process_encoding(&hostCatalog, p_msg, msgLen);
+}
+
+#if BB_MAX_NCOMMANDS > 0
+void catalog_command(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  bb_catalog_process_command(&hostCatalog, p_msg, msgLen);
+}
+#endif
+
+double decoded[BB_MAX_NFIELDS];
+uint8_t ndecoded;
+
+void save_value(void* p_ctx, uint8_t field_id, double value)
+{
+  printf("  field %d = %f\n", field_id, value);
+  decoded[field_id] = value;
+  ndecoded += 1;
+}
+
+
+#pragma pack(push, 1)
+typedef struct
+{
+  float   setpoint;
+  int16_t rate;
+} setpointArgs;
+#pragma pack(pop)
+
+float setpoint = 0;
+int16_t rate = 0;
+uint32_t ncmds = 0;
+
+void set_setpoint(void* p_args)
+{
+  setpointArgs* p_a = (setpointArgs*)p_args;
+
+  setpoint = p_a->setpoint;
+  rate = p_a->rate;
+  ncmds += 1;
+}
+
+
+uint32_t counter = 0;
+float pi = 3.141592;
+#ifdef BB_ROM_FIELDS
+static const bbField fieldTable[] = { { "counter", &counter, INT32 },
+				      { "pi",      &pi,      FLOAT32 } };
+#if BB_MAX_NCOMMANDS > 0
+static const bbCommand cmdTable[] = { { "set_setpoint", 2, { FLOAT32, INT16 }, &set_setpoint } };
+#endif
+#endif
+
 bbInstance bbits;
-uint8_t bbuf[64];
+bbGroup counterGroup;
+bbClient clients[2];
+bbFanout fanout;
+bbSegment segs[4];
+uint8_t bbuf[128];
+uint8_t catbuf[256];
+const bbEncoding encodings[] = { { BB_ENC_BITS, 10 },
+				 { BB_ENC_LINEAR, 12, 0.001, 0.0 } };
+
+//Encoding wider than its field, which used to overrun the next value
+bbInstance bbits2;
+uint8_t bbuf2[9 + 1];   //Exactly one raw frame, plus a guard byte
+uint8_t small = 200;
+int32_t big = 123456;
+const bbEncoding badEncodings[] = { { BB_ENC_BITS, 32 }, { BB_ENC_RAW } };
+#ifdef BB_ROM_FIELDS
+static const bbField fieldTable2[] = { { "small", &small, UINT8 },
+				       { "big",   &big,   INT32 } };
+#endif
+
+//Big enough to batch more than 255 minimal msgs
+#define TEST_NBATCHED 257   //Wrapped a uint8_t count to 1
+bbInstance bbits3;
+uint8_t bbuf3[1 + 3 * TEST_NBATCHED];
 
 void main()
 {
-  uint32_t counter = 0;
-  float pi = 3.141592;
+  uint8_t i;
+  int16_t nsegs;
+  uint32_t n;
+#if BB_MAX_NDEADBANDS > 0
+  uint32_t nsent;
+#endif
+  uint16_t result = 0;
+  int16_t len;
+  uint8_t frame[32];
+  uint8_t expected[32];
+  uint8_t pub32[1 + 4 + sizeof(enum Datatype) + BB_MAX_VARNAMELEN];
+  enum Datatype pubType = FLOAT32;
+#if BB_MAX_NCOMMANDS > 0
+  clock_t start;
+#ifndef BB_ROM_FIELDS
+  enum Datatype setpointTypes[] = { FLOAT32, INT16 };
+#endif
+  uint8_t cmdMsg[2 + sizeof(setpointArgs)];
+  setpointArgs args = { 42.0, -3 };
+#endif
   
 
   printf("Initializing babelbits instance...\n");
-  bb_init(&bbits, bbuf, 64);
+  bb_init(&bbits, bbuf, 128);
   printf("Babelbits instance initialized.\n");
 
   printf("Registering fields...\n");
+#ifdef BB_ROM_FIELDS
+  bb_register_fields(&bbits, fieldTable, 2);
+#else
   bb_register_field(&bbits, &counter, INT32, "counter");
   bb_register_field(&bbits, &pi, FLOAT32, "pi");
+#endif
   printf("Fields registered.\n");
+  printf("Instance RAM: %d bytes\n", (int)sizeof(bbInstance));
 
   print_fields(&bbits);
 
+  bb_register_handler(&bbits, BB_PUBLISH, &print_publish);
+
   bb_publish_field(&bbits, &(bbits.fields[0]));
   printf("Done.\n");
 
@@ -246,6 +1798,299 @@ void main()
     printf("Bytes waiting to be sent: %d\n", bbits.out_bytes_waiting);
 
   bb_processMessage(&bbits, bbits.p_out_msgbuf, bbits.out_bytes_waiting);
+  bbits.out_bytes_waiting = 0;
+
+  printf("Batching both publishes...\n");
+  bb_set_batching(&bbits, 128, 10);
+  bb_publish_field(&bbits, &(bbits.fields[0]));
+  bb_publish_field(&bbits, &(bbits.fields[1]));
+  bb_poll_batch(&bbits, 0);
+  bb_poll_batch(&bbits, 10);
+
+  if(bbits.out_bytes_waiting > 0)
+    printf("Bytes waiting to be sent: %d\n", bbits.out_bytes_waiting);
+
+  bb_processMessage(&bbits, bbits.p_out_msgbuf, bbits.out_bytes_waiting);
+  bbits.out_bytes_waiting = 0;
+
+  //More entries than a byte can count must still go out as one batch
+  bb_init(&bbits3, bbuf3, sizeof(bbuf3));
+  bb_set_batching(&bbits3, sizeof(bbuf3), 10);
+  for(n = 0; n < TEST_NBATCHED; n++)
+    if(bb_send_handshake(&bbits3) != 1) result |= 0x04;
+  bb_flush(&bbits3);
+  if(bbits3.out_bytes_waiting != sizeof(bbuf3) || bbuf3[0] != BB_BATCH ||
+     bbuf3[1] != 0 || bbuf3[2] != 1 || bbuf3[3] != BB_HANDSHAKE_INIT)
+    result |= 0x04;
+
+  printf("Sampling grouped fields into TM frame...\n");
+  bb_set_batching(&bbits, 0, 0);
+  bb_set_field_group(&bbits, 0, bb_register_group(&bbits, &counterGroup));
+  bb_set_field_group(&bbits, 1, 0);
+  BB_MASK_SET(bbits.subscriptions, 0);
+  BB_MASK_SET(bbits.subscriptions, 1);
+
+  bb_group_write_begin(&counterGroup);
+  counter += 1;
+  pi = 3.14159265;
+  bb_group_write_end(&counterGroup);
+
+  printf("TM frame bytes: %d\n", bb_send_tmpacket(&bbits));
+  bbits.out_bytes_waiting = 0;
+
+  printf("Fanning out to 2 clients...\n");
+  bb_client_init(&clients[0]);
+  bb_client_init(&clients[1]);
+  BB_MASK_SET(clients[0].subscriptions, 0);
+  BB_MASK_SET(clients[0].subscriptions, 1);
+  BB_MASK_SET(clients[1].subscriptions, 1);
+  bb_fanout_init(&fanout, clients, 2);
+
+  len = bb_fanout_sample(&bbits, &fanout);
+  printf("Encoded bytes: %d\n", len);
+  if(len != 2 * 5) result |= 0x01;
+
+  //Each client's frame must match what it would get from its own instance
+  expected[0] = BB_TMPACKET;
+  expected[1] = 0;
+  memcpy(&expected[2], &counter, 4);
+  expected[6] = 1;
+  memcpy(&expected[7], &pi, 4);
+
+  for(i = 0; i < 2; i++)
+    {
+      nsegs = bb_fanout_frame(&bbits, &fanout, &clients[i], segs, 4);
+      len = bb_segments_copy(segs, nsegs, frame, sizeof(frame));
+      printf("Client %d frame: %d segments, %d bytes\n", i, nsegs, len);
+
+      if(i == 0 && (len != 11 || memcmp(frame, expected, 11) != 0)) result |= 0x01;
+      if(i == 1 && (len != 6 || frame[0] != BB_TMPACKET || memcmp(&frame[1], &expected[6], 5) != 0))
+	result |= 0x01;
+    }
+
+#if BB_MAX_NDEADBANDS > 0
+  //Client 1 also takes counter on-change. Only that client is affected.
+  bb_client_processMessage(&bbits, &clients[1], catbuf,
+			   bb_make_subscribe_onchange(catbuf, 0, BB_SUB_DEADBAND_ABS, 5, 0, 0));
+  if(bbits.deadbands[0].mode != BB_SUB_PERIODIC || clients[0].deadbands[0].mode != BB_SUB_PERIODIC)
+    result |= 0x01;
+
+  bb_fanout_sample(&bbits, &fanout);
+  nsegs = bb_fanout_deadbands(&bbits, &fanout, &clients[1], 0, segs, 4);
+  len = bb_segments_copy(segs, nsegs, frame, sizeof(frame));
+  if(len != 6 || memcmp(frame, expected, 6) != 0) result |= 0x01;
+  if(bb_fanout_deadbands(&bbits, &fanout, &clients[1], 1, segs, 4) != 0 ||
+     bb_fanout_deadbands(&bbits, &fanout, &clients[0], 1, segs, 4) != 0)
+    result |= 0x01;
+
+  bb_group_write_begin(&counterGroup);
+  counter += 10;
+  bb_group_write_end(&counterGroup);
+  memcpy(&expected[2], &counter, 4);
+
+  bb_fanout_sample(&bbits, &fanout);
+  nsegs = bb_fanout_deadbands(&bbits, &fanout, &clients[1], 2, segs, 4);
+  len = bb_segments_copy(segs, nsegs, frame, sizeof(frame));
+  if(len != 6 || memcmp(frame, expected, 6) != 0) result |= 0x01;
+#endif
+
+  //Sample torn by a writer: no frames from the stale encoding
+  bb_group_write_begin(&counterGroup);
+  if(bb_fanout_sample(&bbits, &fanout) != -3 ||
+     bb_fanout_frame(&bbits, &fanout, &clients[0], segs, 4) != -3)
+    result |= 0x01;
+#if BB_MAX_NDEADBANDS > 0
+  if(bb_fanout_deadbands(&bbits, &fanout, &clients[1], 100, segs, 4) != -3) result |= 0x01;
+#endif
+  bb_group_write_end(&counterGroup);
+
+#if BB_MAX_NCOMMANDS > 0
+  printf("Timing command dispatch...\n");
+  cmdMsg[0] = BB_COMMAND;
+#ifdef BB_ROM_FIELDS
+  cmdMsg[1] = bb_register_commands(&bbits, cmdTable, 1);
+#else
+  cmdMsg[1] = bb_register_command(&bbits, "set_setpoint", &set_setpoint, 2, setpointTypes);
+#endif
+  memcpy(&cmdMsg[2], &args, sizeof(args));
+
+  start = clock();
+  for(n = 0; n < 1000000; n++)
+    bb_processMessage(&bbits, cmdMsg, sizeof(cmdMsg));
+  printf("%d commands, setpoint %.1f, %.1f ns/command\n", ncmds, setpoint,
+	 1e9 * (double)(clock() - start) / CLOCKS_PER_SEC / 1000000);
+  if(cmdMsg[1] != 0 || ncmds != 1000000 || setpoint != 42.0 || rate != -3) result |= 0x02;
+
+  //Wrong arg length & unknown command are both dropped
+  bb_processMessage(&bbits, cmdMsg, sizeof(cmdMsg) - 1);
+  cmdMsg[1] = 7;
+  bb_processMessage(&bbits, cmdMsg, sizeof(cmdMsg));
+  if(ncmds != 1000000) result |= 0x02;
+#endif
+
+  printf("Packing TM frame...\n");
+  if(bb_set_encodings(&bbits, encodings) != 0) result |= 0x10;
+  bb_catalog_init(&hostCatalog);
+  bb_register_handler(&bbits, BB_PUBLISH, &catalog_publish);
+  bb_register_handler(&bbits, BB_ENCODING, &catalog_encoding);
+#if BB_MAX_NCOMMANDS > 0
+  bb_register_handler(&bbits, BB_PUBLISH_COMMAND, &catalog_command);
+#endif
+  bb_processMessage(&bbits, catbuf, bb_make_catalog(&bbits, catbuf, sizeof(catbuf)));
+  if(hostCatalog.nfields != 2 || hostCatalog.encodings[1].kind != BB_ENC_LINEAR)
+    result |= 0x10;
+
+#if BB_MAX_NCOMMANDS > 0
+  //Catalog also told the host how to call set_setpoint
+  i = bb_catalog_find_command(&hostCatalog, "set_setpoint");
+  if(i != 0 || hostCatalog.commands[0].nargs != 2 ||
+     hostCatalog.commands[0].argTypes[0] != FLOAT32 || hostCatalog.commands[0].argTypes[1] != INT16 ||
+     bb_catalog_find_command(&hostCatalog, "nope") != -1)
+    result |= 0x02;
+#endif
+
+  len = bb_send_tmpacket(&bbits);
+  printf("Raw frame: %d bytes, ", len);
+  bbits.out_bytes_waiting = 0;
+  n = bb_send_tmpacked(&bbits);
+  printf("packed frame: %d bytes\n", n);
+  if(n != 5 || 2 * n > len) result |= 0x10;
+
+  ndecoded = 0;
+  if(bb_decode_tmpacked(&hostCatalog, &(bbuf[1]), bbits.out_bytes_waiting - 1,
+			&save_value, 0) != 2 ||
+     ndecoded != 2 || decoded[0] != counter || decoded[1] < pi - 0.001 || decoded[1] > pi + 0.001)
+    result |= 0x10;
+  bbits.out_bytes_waiting = 0;
+
+  //BITS values out of range saturate instead of wrapping
+  n = counter;
+  counter = 5000;
+  bb_send_tmpacked(&bbits);
+  bb_decode_tmpacked(&hostCatalog, &(bbuf[1]), bbits.out_bytes_waiting - 1, &save_value, 0);
+  if(decoded[0] != 511) result |= 0x10;
+  bbits.out_bytes_waiting = 0;
+  counter = (uint32_t)-5000;
+  bb_send_tmpacked(&bbits);
+  bb_decode_tmpacked(&hostCatalog, &(bbuf[1]), bbits.out_bytes_waiting - 1, &save_value, 0);
+  if(decoded[0] != -512) result |= 0x10;
+  bbits.out_bytes_waiting = 0;
+  counter = n;
+
+  //Single publishes from a device w/ 32-bit pointers land at their ids,
+  //whatever order they come in, & a re-publish doesn't add a field
+  memset(pub32, 0, sizeof(pub32));
+  memcpy(&pub32[5], &pubType, sizeof(pubType));
+  bb_catalog_init(&hostCatalog);
+  pub32[0] = 3;
+  bb_catalog_process_publish(&hostCatalog, pub32, sizeof(pub32));
+  pub32[0] = 0;
+  bb_catalog_process_publish(&hostCatalog, pub32, sizeof(pub32));
+  bb_catalog_process_publish(&hostCatalog, pub32, sizeof(pub32));
+  if(hostCatalog.nfields != 4 || hostCatalog.types[0] != FLOAT32 ||
+     hostCatalog.types[3] != FLOAT32 || hostCatalog.types[1] != UNKNOWN)
+    result |= 0x10;
+
+  //Frame naming a field that was never published can't be decoded
+  bbuf[0] = 0x02;
+  if(bb_decode_tmpacked(&hostCatalog, bbuf, 8, &save_value, 0) != -1) result |= 0x10;
+
+  //Encoding wider than its type is refused, & sent raw if it gets in anyway
+  bb_init(&bbits2, bbuf2, 9);
+#ifdef BB_ROM_FIELDS
+  bb_register_fields(&bbits2, fieldTable2, 2);
+#else
+  bb_register_field(&bbits2, &small, UINT8, "small");
+  bb_register_field(&bbits2, &big, INT32, "big");
+#endif
+  if(bb_set_encodings(&bbits2, badEncodings) == 0) result |= 0x10;
+  bbits2.encodings = badEncodings;
+  BB_MASK_SET(bbits2.subscriptions, 0);
+  BB_MASK_SET(bbits2.subscriptions, 1);
+  bbuf2[9] = 0xa5;
+
+  bb_catalog_init(&hostCatalog);
+  bb_register_handler(&bbits2, BB_PUBLISH, &catalog_publish);
+  bb_register_handler(&bbits2, BB_ENCODING, &catalog_encoding);
+  bb_processMessage(&bbits2, catbuf, bb_make_catalog(&bbits2, catbuf, sizeof(catbuf)));
+
+  ndecoded = 0;
+  len = bb_send_tmpacked(&bbits2);
+  if(len < 0 || len > 9 || bbuf2[9] != 0xa5 ||
+     bb_decode_tmpacked(&hostCatalog, &(bbuf2[1]), len - 1, &save_value, 0) != 2 ||
+     decoded[0] != small || decoded[1] != big)
+    result |= 0x10;
+
+#if BB_MAX_NDEADBANDS > 0
+  printf("Polling on-change fields...\n");
+  bb_processMessage(&bbits, catbuf,
+		    bb_make_subscribe_onchange(catbuf, 1, BB_SUB_DEADBAND_ABS, 0.01, 2, 50));
+  if(BB_MASK_GET(bbits.subscriptions, 1)) result |= 0x20;
+
+  //First poll always sends, then nothing until it moves or max_interval
+  pi = 1.0;
+  if(bb_poll_deadbands(&bbits, 0) != 1 + 5) result |= 0x20;
+  bbits.out_bytes_waiting = 0;
+  pi = 1.005;                                              //Inside band
+  if(bb_poll_deadbands(&bbits, 10) != 0) result |= 0x20;
+  if(bb_poll_deadbands(&bbits, 50) != 1 + 5) result |= 0x20;  //max_interval
+  bbits.out_bytes_waiting = 0;
+
+  //Step while a msg is waiting: not sent, not marked sent, msg untouched
+  pi = 2.0;
+  if(bb_send_handshake(&bbits) != 1 || bb_send_handshake(&bbits) != -2) result |= 0x20;
+  if(bb_poll_deadbands(&bbits, 60) != -2 || bbits.out_bytes_waiting != 1 ||
+     bbuf[0] != BB_HANDSHAKE_INIT)
+    result |= 0x20;
+  bbits.out_bytes_waiting = 0;
+  if(bb_poll_deadbands(&bbits, 61) != 1 + 5 || bbuf[0] != BB_TMPACKET ||
+     bbuf[1] != 1 || memcmp(&bbuf[2], &pi, 4) != 0)
+    result |= 0x20;
+  bbits.out_bytes_waiting = 0;
+
+  //Jitter inside the band w/ occasional steps: between one frame per
+  //max_interval & one per min_interval
+  nsent = 0;
+  for(n = 100; n < 1100; n++)
+    {
+      pi = 3.14159265 + ((n % 100) < 50 ? 0.001 : 0.1) * (n % 7);  //Jitter, then steps
+      if(bb_poll_deadbands(&bbits, n) > 0) nsent += 1;
+      bbits.out_bytes_waiting = 0;
+    }
+  printf("%d of 1000 ticks sent a frame\n", nsent);
+  if(nsent < 1000 / 50 || nsent > 1000 / 2) result |= 0x20;
+#endif
+
+  if( result & 0x01 )
+    printf("\nMulti-client fan-out:\t\t --FAILED--");
+  else
+    printf("\nMulti-client fan-out:\t\t --PASSED--");
+
+#if BB_MAX_NCOMMANDS > 0
+  if( result & 0x02 )
+    printf("\nCommand dispatch:\t\t --FAILED--");
+  else
+    printf("\nCommand dispatch:\t\t --PASSED--");
+#endif
+
+  if( result & 0x04 )
+    printf("\nBatching:\t\t\t --FAILED--");
+  else
+    printf("\nBatching:\t\t\t --PASSED--");
+
+  if( result & 0x10 )
+    printf("\nPacked TM frames:\t\t --FAILED--");
+  else
+    printf("\nPacked TM frames:\t\t --PASSED--");
+
+#if BB_MAX_NDEADBANDS > 0
+
+  if( result & 0x20 )
+    printf("\nDeadband emission:\t\t --FAILED--\n");
+  else
+    printf("\nDeadband emission:\t\t --PASSED--");
+#endif
+  printf("\n");
 }
 
 #endif
@@ -8,12 +8,50 @@
  * Test configuration: See babelbits.c
  *--------------------------------------------------------------------*/
 
-#include <stdarg.h>   //Needed for variadic function def in bbCommand
-
 #define BB_MAX_VARNAMELEN 32
-#define BB_MAX_NFIELDS 64
+#ifndef BB_MAX_NFIELDS
+#define BB_MAX_NFIELDS 64  //Can be lowered at compile time to save RAM
+#endif
+#define BB_FIELD_MASKLEN ((BB_MAX_NFIELDS + 7) / 8)  //Bytes in a per-field bitmap
 #define BB_MAX_NARGS 16
+#ifndef BB_MAX_NCOMMANDS
+#define BB_MAX_NCOMMANDS 8  //0 compiles commands out
+#endif
+#define BB_MAX_ARGSLEN 64  //Largest packed argument block a command can take
 #define BB_MIN_BUFLEN 64   //Minimum BB out buffer length needed
+#ifndef BB_MAX_MSGTYPES
+#define BB_MAX_MSGTYPES 32 //Size of message dispatch table, 0 = built-ins only
+#endif
+#define BB_USER_MSGTYPE 16 //First message type free for application use
+#define BB_MAX_NGROUPS 8   //Max seqlock-protected field groups
+#define BB_NO_GROUP 0xff
+#define BB_MAX_ENTRYLEN 9  //Largest TM frame entry, field_id(1) + 64-bit value
+#define BB_SAMPLE_MAX_RETRIES 16  //Give up on a TM frame after this many torn reads
+#ifndef BB_MAX_NDEADBANDS
+#define BB_MAX_NDEADBANDS 16  //Max fields subscribed on-change at once, 0 compiles them out
+#endif
+
+//Per-field bitmaps (subscriptions etc.), LSB first like the BB_TMPACKED mask
+#define BB_MASK_GET(p_mask, i) (((p_mask)[(i) >> 3] >> ((i) & 0x07)) & 1)
+#define BB_MASK_SET(p_mask, i) ((p_mask)[(i) >> 3] |= (uint8_t)(1 << ((i) & 0x07)))
+#define BB_MASK_CLR(p_mask, i) ((p_mask)[(i) >> 3] &= (uint8_t)~(1 << ((i) & 0x07)))
+
+//Memory barrier used by field group seqlocks. Override for compilers
+//w/o GCC builtins (e.g. __DMB() on Cortex-M w/ CMSIS).
+#ifndef BB_BARRIER
+#define BB_BARRIER() __sync_synchronize()
+#endif
+
+//Diagnostic output hook. Compile w/ -DBB_TRACE_ENABLE to send it to
+//printf, or define BB_TRACE(...) yourself to route it elsewhere.
+#ifndef BB_TRACE
+#ifdef BB_TRACE_ENABLE
+#include <stdio.h>
+#define BB_TRACE(...) printf(__VA_ARGS__)
+#else
+#define BB_TRACE(...)
+#endif
+#endif
 
 
 enum Datatype
@@ -41,8 +79,18 @@ enum bbMsgType
     BB_UNSUBSCRIBE,                   //Client unsubscribes to a field
     BB_TMPACKET,                      //Host sends telemetry update
     BB_TXTPACKET,
+    BB_BATCH,                         //Several length-prefixed BB msgs in one
+    BB_REL_DATA,                      //Reliable channel data, see babelbits_rel.c
+    BB_REL_SACK,                      //Reliable channel selective ack
+    BB_COMMAND,                       //Client invokes a registered command
+    BB_TMPACKED,                      //Telemetry w/ quantized/bit-packed values
+    BB_ENCODING,                      //Host sends a field's encoding descriptor
+    BB_FRAGMENT,                      //Piece of a bulk msg, see babelbits_sched.c
+    BB_PUBLISH_COMMAND,               //Host sends a command's id, arg types & name
   };
 
+#define BB_BATCH_ENTRY_HDRLEN 2   //Big-endian length before each batched msg
+
 //Message structs
 typedef struct
 {
@@ -54,6 +102,29 @@ typedef struct
   uint8_t field_id;
 } bbMsg_Unsubscribe;
 
+//Subscription modes. A BB_SUBSCRIBE w/ just the field_id is periodic.
+enum bbSubscribeMode
+  {
+    BB_SUB_PERIODIC,       //Sent in every bb_send_tmpacket() frame
+    BB_SUB_DEADBAND_ABS,   //Sent when it moves more than threshold
+    BB_SUB_DEADBAND_PCT    //Sent when it moves more than threshold % of last sent
+  };
+
+//Extended BB_SUBSCRIBE for on-change fields. Native byte order, intervals
+//in the time units passed to bb_poll_deadbands(). A field isn't sent
+//more often than min_interval, and is re-sent after max_interval even if
+//it hasn't moved (0 = never).
+#pragma pack(push, 1)
+typedef struct
+{
+  uint8_t field_id;
+  uint8_t mode;            //enum bbSubscribeMode
+  float threshold;
+  uint32_t min_interval;
+  uint32_t max_interval;
+} bbMsg_SubscribeOnChange;
+#pragma pack(pop)
+
 //---------------
 
 enum bbConnectionState
@@ -78,6 +149,20 @@ enum Unit
   };
 
 //Basic TM field - generic housekeeping data
+//
+//Compile w/ -DBB_ROM_FIELDS for RAM-constrained targets: the field table
+//is then a const array the application keeps in flash and hands to
+//bb_register_fields(), and the instance only stores a pointer to it.
+//Per-field RAM is down to a subscription bit & group byte. Wire protocol is
+//the same either way.
+#ifdef BB_ROM_FIELDS
+typedef struct
+{
+  const char* p_name;
+  void* p_var;
+  uint8_t type;      //enum Datatype
+} bbField;
+#else
 #pragma pack(push, 1)
 typedef struct
 {
@@ -86,6 +171,64 @@ typedef struct
   char name[BB_MAX_VARNAMELEN];
 } bbField;
 #pragma pack(pop)
+#endif
+
+//BB_PUBLISH is | msgType | field_id | p_var | type (enum-sized) | name, zero padded |
+#define BB_PUBLISH_MSGLEN (2 + sizeof(void*) + sizeof(enum Datatype) + BB_MAX_VARNAMELEN)
+
+//How a field's value is put on the wire in BB_TMPACKED frames
+enum bbEncodingKind
+  {
+    BB_ENC_RAW,       //Full type width, native byte order
+    BB_ENC_LINEAR,    //Float types only, nbits unsigned int, value = raw * scale + offset
+    BB_ENC_BITS       //Integer types only, low nbits (signed ones sign-extend), saturating
+  };
+
+typedef struct
+{
+  uint8_t kind;       //enum bbEncodingKind
+  uint8_t nbits;      //Wire width for LINEAR & BITS, 1-32 & <= type's bits
+  float scale;
+  float offset;
+} bbEncoding;
+
+//BB_ENCODING is | msgType | field_id | kind | nbits | scale | offset |,
+//scale & offset as native float32
+#define BB_ENCODING_MSGLEN (4 + 2 * sizeof(float))
+
+//State of one on-change subscription
+typedef struct
+{
+  uint8_t field_id;
+  uint8_t mode;            //enum bbSubscribeMode, BB_SUB_PERIODIC = slot free
+  uint8_t sent;            //Set once last_value is valid
+  float threshold;
+  uint32_t min_interval;
+  uint32_t max_interval;
+  uint32_t last_time;      //When field was last sent
+  double last_value;       //Value last sent
+} bbDeadband;
+
+//Seqlock for a group of fields the application updates together. The
+//writer (one thread/ISR per group) brackets its updates w/
+//bb_group_write_begin()/end() and never blocks. Telemetry copies the
+//group out and retries only if a write overlapped the copy.
+typedef struct
+{
+  volatile uint32_t seq;   //Odd while a write is in progress
+} bbGroup;
+
+static inline void bb_group_write_begin(bbGroup* p_group)
+{
+  p_group->seq += 1;
+  BB_BARRIER();
+}
+
+static inline void bb_group_write_end(bbGroup* p_group)
+{
+  BB_BARRIER();
+  p_group->seq += 1;
+}
 
 /*
 //Sensor field - has units, can be calibrated
@@ -101,48 +244,214 @@ typedef struct
   bbSensor* p_sensor;   //Actuator status
   void* p_cmd;          //Current command
 } bbActuator;
+*/
 
-//http://publications.gbdirect.co.uk/c_book/chapter9/stdarg.html
-//http://en.wikipedia.org/wiki/Variadic_function
+//Command the client can invoke on the device. Args arrive packed in
+//order, native byte order, and are handed to p_cmdfcn in an aligned
+//block the function can cast to a packed struct of the arg types. The
+//name isn't copied, so it must stay valid (e.g. a string literal).
+//Under BB_ROM_FIELDS commands come from a const table too, so there's
+//no precomputed argsLen to fill in.
 typedef struct
 {
-  char name[MAX_VARNAMELEN];   //Could just be a pointer to a user-deffed string?
+  const char* p_name;
   uint8_t nargs;
-  enum Datatype[MAX_NARGS];
-  char argNames[MAX_NARGS][MAX_VARNAMELEN]; //Could just be a desc. string?
-  void (*p_cmdfcn)(...);   //FIXMEOHGOD
+  uint8_t argTypes[BB_MAX_NARGS];   //enum Datatype
+#ifndef BB_ROM_FIELDS
+  uint8_t argsLen;                  //Precomputed from argTypes at registration
+#endif
+  void (*p_cmdfcn)(void* p_args);
 } bbCommand;
 
-*/
+//BB_PUBLISH_COMMAND is | msgType | cmd_id | nargs | argTypes | name, zero padded |
+#define BB_PUBLISH_COMMAND_MSGLEN(nargs) (3 + (nargs) + BB_MAX_VARNAMELEN)
+
+struct bbInstance_s;
+
+//Message handler, p_msg points just past the message type byte
+typedef void (*bbMsgHandler)(struct bbInstance_s* p_bb, uint8_t* p_msg, uint16_t msgLen);
 
 //Struct to keep all babelbits info
-typedef struct
+typedef struct bbInstance_s
 {
   uint8_t nfields;       //Number of fields registered
+#ifdef BB_ROM_FIELDS
+  const bbField* fields;          //Application's const table, in flash
+#else
   bbField fields[BB_MAX_NFIELDS]; //Declared w/ max to avoid dynamic mem alloc
+#endif
+
+  //Bit per field the client is subscribed to, see BB_MASK_GET()
+  uint8_t subscriptions[BB_FIELD_MASKLEN];
+
+  //On-change subscriptions. Those fields aren't in subscriptions[], they
+  //go out in frames from bb_poll_deadbands() instead.
+#if BB_MAX_NDEADBANDS > 0
+  bbDeadband deadbands[BB_MAX_NDEADBANDS];
+#endif
 
-  //Array contains bools indicating which fields client is subscribed to
-//Note: could be string of bits instead of bytes & just use bit shifts+mask
-  uint8_t subscriptions[BB_MAX_NFIELDS];
+  //Seqlock groups, and which group (or BB_NO_GROUP) each field is in
+  uint8_t ngroups;
+  bbGroup* p_groups[BB_MAX_NGROUPS];
+  uint8_t field_groups[BB_MAX_NFIELDS];
+
+#if BB_MAX_NCOMMANDS > 0
+  uint8_t ncommands;
+#ifdef BB_ROM_FIELDS
+  const bbCommand* commands;            //Application's const table, in flash
+#else
+  bbCommand commands[BB_MAX_NCOMMANDS];
+#endif
+#endif
+
+  //Optional table of encodings indexed by field id, 0 = all raw. Can be
+  //const, so it may live in flash next to a ROM field table.
+  const bbEncoding* encodings;
 
   uint8_t* p_out_msgbuf;       //Buffer for outgoing BB messages
   uint16_t out_msgbuf_len;     
   uint16_t out_bytes_waiting;  //Lets user know BB wants to send a msg
 
+  //Batching. While enabled, outgoing msgs collect in p_out_msgbuf as one
+  //BB_BATCH msg, which only shows up in out_bytes_waiting once it's full,
+  //has waited batch_max_delay, or bb_flush() is called.
+  uint16_t batch_max_bytes;    //0 = batching off
+  uint32_t batch_max_delay;    //Same time units user passes to bb_poll_batch()
+  uint16_t batch_len;          //Bytes in open batch, 0 if none open
+  uint16_t batch_nmsgs;        //1-byte msgs take 3 bytes, so >255 fit a big buffer
+  uint8_t  batch_timing;       //Set once bb_poll_batch() has seen open batch
+  uint32_t batch_start;
+
   uint8_t connection_state;
 
   void (*txt_msg_handler)(uint8_t* p_txt);
+
+  //Dispatch table, indexed by message type
+#if BB_MAX_MSGTYPES > 0
+  bbMsgHandler msg_handlers[BB_MAX_MSGTYPES];
+#endif
 } bbInstance;
 
 
+//One ground console served by a multi-client instance
+typedef struct
+{
+  uint8_t subscriptions[BB_FIELD_MASKLEN];
+#if BB_MAX_NDEADBANDS > 0
+  bbDeadband deadbands[BB_MAX_NDEADBANDS];   //This client's on-change fields
+#endif
+  uint8_t connection_state;
+} bbClient;
+
+//Piece of an outgoing frame, sent in order w/ the others
+typedef struct
+{
+  const uint8_t* p_data;
+  uint16_t len;
+} bbSegment;
+
+//Shared per-tick encoding of every field any client subscribes to.
+//Client frames reference this instead of encoding their own copy.
+typedef struct
+{
+  bbClient* p_clients;
+  uint8_t nclients;
+
+  uint8_t encoded[BB_MAX_NFIELDS * BB_MAX_ENTRYLEN];
+  uint16_t encoded_len;
+  uint16_t offsets[BB_MAX_NFIELDS];      //Where each field's entry is
+  uint8_t encoded_mask[BB_FIELD_MASKLEN]; //Fields encoded this tick
+  uint8_t valid;                         //Cleared if last sample failed
+} bbFanout;
+
+//Host-side view of a device command, from its BB_PUBLISH_COMMAND
+typedef struct
+{
+  char name[BB_MAX_VARNAMELEN];
+  uint8_t nargs;                    //0xff = no such command published
+  uint8_t argTypes[BB_MAX_NARGS];   //enum Datatype
+} bbCommandInfo;
+
+//Host-side view of a device's fields & commands, built from its
+//BB_PUBLISH, BB_ENCODING & BB_PUBLISH_COMMAND msgs, used to decode
+//BB_TMPACKED frames & build BB_COMMAND msgs
+typedef struct
+{
+  uint8_t nfields;
+  uint8_t types[BB_MAX_NFIELDS];
+  bbEncoding encodings[BB_MAX_NFIELDS];
+#if BB_MAX_NCOMMANDS > 0
+  bbCommandInfo commands[BB_MAX_NCOMMANDS];
+#endif
+} bbCatalog;
+
+
 //Public functions
 //------------------------------------------------------------------
 void bb_init(bbInstance* p_bb, uint8_t* p_buf, uint16_t buflen);
-void bb_send_handshake(bbInstance* p_bb);
+int8_t bb_send_handshake(bbInstance* p_bb);
 void bb_processMessage(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen);
+int8_t bb_register_handler(bbInstance* p_bb, uint8_t msgType, bbMsgHandler p_handler);
+#ifdef BB_ROM_FIELDS
+int8_t bb_register_fields(bbInstance* p_bb, const bbField* p_table, uint8_t nfields);
+#else
 void bb_register_field(bbInstance* p_bb, void* p_var, enum Datatype type, char* p_name);
-int8_t bb_publish_field(bbInstance* p_bb, bbField* p_field);
+#endif
+int8_t bb_publish_field(bbInstance* p_bb, const bbField* p_field);
+uint16_t bb_make_publish(const bbField* p_field, uint8_t field_id, uint8_t* p_out);
+uint16_t bb_make_catalog(bbInstance* p_bb, uint8_t* p_out, uint16_t outLen);
+int8_t bb_set_encodings(bbInstance* p_bb, const bbEncoding* p_table);
+uint16_t bb_make_encoding(bbInstance* p_bb, uint8_t field_id, uint8_t* p_out);
+int16_t bb_send_tmpacked(bbInstance* p_bb);
+#if BB_MAX_NDEADBANDS > 0
+int16_t bb_poll_deadbands(bbInstance* p_bb, uint32_t now);
+#endif
+uint16_t bb_make_subscribe_onchange(uint8_t* p_out, uint8_t field_id, uint8_t mode,
+				    float threshold, uint32_t min_interval,
+				    uint32_t max_interval);
+void bb_set_batching(bbInstance* p_bb, uint16_t max_bytes, uint32_t max_delay);
+void bb_poll_batch(bbInstance* p_bb, uint32_t now);
+void bb_flush(bbInstance* p_bb);
+int8_t bb_register_group(bbInstance* p_bb, bbGroup* p_group);
+int8_t bb_set_field_group(bbInstance* p_bb, uint8_t field_id, uint8_t group_id);
+int16_t bb_send_tmpacket(bbInstance* p_bb);
+uint8_t bb_type_size(enum Datatype type);
+//Host-side decoding
+void bb_catalog_init(bbCatalog* p_cat);
+void bb_catalog_process_publish(bbCatalog* p_cat, uint8_t* p_msg, uint16_t msgLen);
+void bb_catalog_process_encoding(bbCatalog* p_cat, uint8_t* p_msg, uint16_t msgLen);
+int16_t bb_decode_tmpacked(bbCatalog* p_cat, uint8_t* p_msg, uint16_t msgLen,
+			   void (*p_value)(void* p_ctx, uint8_t field_id, double value),
+			   void* p_ctx);
+#if BB_MAX_NCOMMANDS > 0
+void bb_catalog_process_command(bbCatalog* p_cat, uint8_t* p_msg, uint16_t msgLen);
+int8_t bb_catalog_find_command(bbCatalog* p_cat, const char* p_name);
+
+#ifdef BB_ROM_FIELDS
+int8_t bb_register_commands(bbInstance* p_bb, const bbCommand* p_table, uint8_t ncommands);
+#else
+int8_t bb_register_command(bbInstance* p_bb, const char* p_name, void (*p_cmdfcn)(void* p_args),
+			   uint8_t nargs, enum Datatype* p_argTypes);
+#endif
+int8_t bb_publish_command(bbInstance* p_bb, uint8_t cmd_id);
+uint16_t bb_make_command_publish(bbInstance* p_bb, uint8_t cmd_id, uint8_t* p_out);
+#endif
+
+//Multi-client fan-out
+void bb_client_init(bbClient* p_client);
+void bb_client_processMessage(bbInstance* p_bb, bbClient* p_client,
+			      uint8_t* p_msg, uint16_t msgLen);
+void bb_fanout_init(bbFanout* p_fan, bbClient* p_clients, uint8_t nclients);
+int16_t bb_fanout_sample(bbInstance* p_bb, bbFanout* p_fan);
+int16_t bb_fanout_frame(bbInstance* p_bb, bbFanout* p_fan, bbClient* p_client,
+			bbSegment* p_segs, uint8_t maxSegs);
+#if BB_MAX_NDEADBANDS > 0
+int16_t bb_fanout_deadbands(bbInstance* p_bb, bbFanout* p_fan, bbClient* p_client,
+			    uint32_t now, bbSegment* p_segs, uint8_t maxSegs);
+#endif
+uint16_t bb_segments_copy(bbSegment* p_segs, uint8_t nsegs, uint8_t* p_out, uint16_t outLen);
 
 //Incoming message handlers
 void bb_process_subscribe(bbInstance* p_bb, bbMsg_Subscribe* p_msg);
 void bb_process_unsubscribe(bbInstance* p_bb, bbMsg_Unsubscribe* p_msg);
+void bb_process_subscribe_onchange(bbInstance* p_bb, bbMsg_SubscribeOnChange* p_msg);
@@ -0,0 +1,119 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_bits.h
+ *
+ * Description: Bit writer/reader for packed TM frames. Bits go out
+ *              MSB first; the writer stores and the reader loads 32
+ *              bits at a time, only the tail is done bytewise.
+ *
+ * Test configuration: See babelbits.c
+ *--------------------------------------------------------------------*/
+
+typedef struct
+{
+  uint8_t* p_out;
+  uint16_t pos;       //Bytes written so far
+  uint64_t acc;       //Pending bits are the low nacc bits
+  uint8_t  nacc;
+} bbBitWriter;
+
+typedef struct
+{
+  const uint8_t* p_in;
+  uint16_t len;
+  uint16_t pos;       //Bytes loaded so far
+  uint64_t acc;       //Unread bits are the low nacc bits
+  uint8_t  nacc;
+} bbBitReader;
+
+
+static inline void bb_bits_writer_init(bbBitWriter* p_w, uint8_t* p_out)
+{
+  p_w->p_out = p_out;
+  p_w->pos = 0;
+  p_w->acc = 0;
+  p_w->nacc = 0;
+}
+
+//Appends low nbits (1-32) of val
+static inline void bb_bits_put(bbBitWriter* p_w, uint32_t val, uint8_t nbits)
+{
+  uint32_t word;
+
+  if(nbits < 32) val &= ((uint32_t)1 << nbits) - 1;
+
+  p_w->acc = (p_w->acc << nbits) | val;
+  p_w->nacc += nbits;
+
+  if(p_w->nacc >= 32)
+    {
+      p_w->nacc -= 32;
+      word = (uint32_t)(p_w->acc >> p_w->nacc);
+
+      p_w->p_out[p_w->pos]     = (word >> 24) & 0xff;
+      p_w->p_out[p_w->pos + 1] = (word >> 16) & 0xff;
+      p_w->p_out[p_w->pos + 2] = (word >> 8) & 0xff;
+      p_w->p_out[p_w->pos + 3] = word & 0xff;
+      p_w->pos += 4;
+    }
+}
+
+//Writes out any partial word, zero padding the last byte. Returns total
+//bytes written.
+static inline uint16_t bb_bits_flush(bbBitWriter* p_w)
+{
+  while(p_w->nacc >= 8)
+    {
+      p_w->nacc -= 8;
+      p_w->p_out[p_w->pos++] = (p_w->acc >> p_w->nacc) & 0xff;
+    }
+
+  if(p_w->nacc > 0)
+    {
+      p_w->p_out[p_w->pos++] = (p_w->acc << (8 - p_w->nacc)) & 0xff;
+      p_w->nacc = 0;
+    }
+
+  return p_w->pos;
+}
+
+
+static inline void bb_bits_reader_init(bbBitReader* p_r, const uint8_t* p_in, uint16_t len)
+{
+  p_r->p_in = p_in;
+  p_r->len = len;
+  p_r->pos = 0;
+  p_r->acc = 0;
+  p_r->nacc = 0;
+}
+
+//Reads next nbits (1-32) into *p_val. Returns 0 if data runs out.
+static inline uint8_t bb_bits_get(bbBitReader* p_r, uint8_t nbits, uint32_t* p_val)
+{
+  if(p_r->nacc < nbits)
+    {
+      if(p_r->pos + 4 <= p_r->len)
+	{
+	  p_r->acc = (p_r->acc << 32) |
+	    ((uint32_t)p_r->p_in[p_r->pos] << 24) | ((uint32_t)p_r->p_in[p_r->pos + 1] << 16) |
+	    ((uint32_t)p_r->p_in[p_r->pos + 2] << 8) | (uint32_t)p_r->p_in[p_r->pos + 3];
+	  p_r->pos += 4;
+	  p_r->nacc += 32;
+	}
+      else
+	{
+	  while(p_r->nacc < nbits && p_r->pos < p_r->len)
+	    {
+	      p_r->acc = (p_r->acc << 8) | p_r->p_in[p_r->pos++];
+	      p_r->nacc += 8;
+	    }
+	  if(p_r->nacc < nbits) return 0;
+	}
+    }
+
+  p_r->nacc -= nbits;
+  *p_val = (uint32_t)(p_r->acc >> p_r->nacc);
+  if(nbits < 32) *p_val &= ((uint32_t)1 << nbits) - 1;
+
+  return 1;
+}
@@ -0,0 +1,432 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_rec.c
+ *
+ * Description: Records received BB msgs w/ timestamps into an indexed
+ *              file, and replays them w/ fast time-seek.
+ *
+ * File format (all integers little-endian):
+ *
+ *       | magic | catalogLen | catalog | records... | index | trailer |
+ *
+ *   catalog - BB_BATCH of BB_PUBLISH msgs, see bb_make_catalog()
+ *    record - | time(4) | msgLen(2) | msg |, msg as hermes delivered it
+ *     index - | time(4) | offset(8) | per BB_REC_CHUNKLEN bytes of records
+ *   trailer - | indexOffset(8) | nindex(4) | "BBIX" |
+ *
+ * Record from the hermes msg handler w/ bb_rec_write(). On replay the file
+ * is mmap'd, bb_replay_seek() binary searches the index then scans at most
+ * one chunk, and bb_replay_run() feeds msgs to bb_processMessage(), either
+ * as fast as possible or paced by the user's wait function. A file w/o
+ * trailer (recorder never closed) still replays, seeking by linear scan.
+ *
+ * Test configuration: uncomment "#define UNIT_TEST"
+ *                     gcc -o babelbits_rec.exe babelbits_rec.c
+ *                     run
+ *--------------------------------------------------------------------*/
+
+//#define UNIT_TEST
+
+#include <stdint.h>  //Needed for explicit-size datatypes (uint8_t, etc)
+#include <stdio.h>
+#include <stdlib.h>  //Needed for realloc
+#include <string.h>
+
+#include <fcntl.h>     //Needed for mmap'ing recordings
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "babelbits.h"
+#include "babelbits_rec.h"
+
+
+static void bb_rec_put(uint8_t* p_out, uint64_t val, uint8_t nbytes);
+static uint64_t bb_rec_get(uint8_t* p_in, uint8_t nbytes);
+
+
+// Creates a recording. The catalog goes in the header so replay can
+// publish the fields before any TM arrives. Returns 0, or -1 on IO error.
+int8_t bb_rec_open(bbRecorder* p_rec, const char* p_path,
+		   uint8_t* p_catalog, uint16_t catalogLen)
+{
+  uint8_t len[4];
+
+  p_rec->p_file = fopen(p_path, "wb");
+  if(p_rec->p_file == 0) return -1;
+
+  p_rec->p_index = 0;
+  p_rec->nindex = 0;
+  p_rec->index_cap = 0;
+  p_rec->chunk_bytes = BB_REC_CHUNKLEN;  //First record starts a chunk
+
+  bb_rec_put(len, catalogLen, 4);
+  if(fwrite(BB_REC_MAGIC, 1, BB_REC_MAGICLEN, p_rec->p_file) != BB_REC_MAGICLEN ||
+     fwrite(len, 1, 4, p_rec->p_file) != 4 ||
+     fwrite(p_catalog, 1, catalogLen, p_rec->p_file) != catalogLen)
+    {
+      fclose(p_rec->p_file);
+      p_rec->p_file = 0;
+      return -1;
+    }
+
+  p_rec->offset = BB_REC_MAGICLEN + 4 + catalogLen;
+  return 0;
+}
+
+// Appends one msg received at time. Times must not go backwards.
+// Returns 0, or -1 on IO/memory error.
+int8_t bb_rec_write(bbRecorder* p_rec, uint32_t time, uint8_t* p_msg, uint16_t msgLen)
+{
+  uint8_t hdr[BB_REC_RECORD_HDRLEN];
+  bbRecIndex* p_index;
+
+  //Start a new chunk, note it in the index
+  if(p_rec->chunk_bytes >= BB_REC_CHUNKLEN)
+    {
+      if(p_rec->nindex == p_rec->index_cap)
+	{
+	  p_index = realloc(p_rec->p_index,
+			    (p_rec->index_cap * 2 + 64) * sizeof(bbRecIndex));
+	  if(p_index == 0) return -1;
+
+	  p_rec->p_index = p_index;
+	  p_rec->index_cap = p_rec->index_cap * 2 + 64;
+	}
+
+      p_rec->p_index[p_rec->nindex].time = time;
+      p_rec->p_index[p_rec->nindex].offset = p_rec->offset;
+      p_rec->nindex += 1;
+      p_rec->chunk_bytes = 0;
+    }
+
+  bb_rec_put(hdr, time, 4);
+  bb_rec_put(&(hdr[4]), msgLen, 2);
+
+  if(fwrite(hdr, 1, BB_REC_RECORD_HDRLEN, p_rec->p_file) != BB_REC_RECORD_HDRLEN ||
+     fwrite(p_msg, 1, msgLen, p_rec->p_file) != msgLen)
+    return -1;
+
+  p_rec->offset += BB_REC_RECORD_HDRLEN + msgLen;
+  p_rec->chunk_bytes += BB_REC_RECORD_HDRLEN + msgLen;
+  return 0;
+}
+
+// Writes index & trailer and closes file. Returns 0, or -1 on IO error.
+int8_t bb_rec_close(bbRecorder* p_rec)
+{
+  uint8_t buf[BB_REC_TRAILERLEN];
+  uint32_t i;
+  int8_t result = 0;
+
+  for(i = 0; i < p_rec->nindex && result == 0; i++)
+    {
+      bb_rec_put(buf, p_rec->p_index[i].time, 4);
+      bb_rec_put(&(buf[4]), p_rec->p_index[i].offset, 8);
+      if(fwrite(buf, 1, BB_REC_INDEX_ENTRYLEN, p_rec->p_file) != BB_REC_INDEX_ENTRYLEN)
+	result = -1;
+    }
+
+  bb_rec_put(buf, p_rec->offset, 8);
+  bb_rec_put(&(buf[8]), p_rec->nindex, 4);
+  memcpy(&(buf[12]), BB_REC_INDEX_MAGIC, 4);
+  if(fwrite(buf, 1, BB_REC_TRAILERLEN, p_rec->p_file) != BB_REC_TRAILERLEN)
+    result = -1;
+
+  if(fclose(p_rec->p_file) != 0) result = -1;
+  p_rec->p_file = 0;
+
+  free(p_rec->p_index);
+  p_rec->p_index = 0;
+
+  return result;
+}
+
+
+// Maps a recording for replay, positioned at its first record.
+// Returns 0, -1 if file can't be mapped, -2 if it isn't a recording.
+int8_t bb_replay_open(bbReplay* p_rp, const char* p_path)
+{
+  int fd;
+  struct stat st;
+  uint8_t* p_trailer;
+  uint64_t index_offset;
+
+  fd = open(p_path, O_RDONLY);
+  if(fd < 0) return -1;
+
+  if(fstat(fd, &st) != 0 || st.st_size < BB_REC_MAGICLEN + 4)
+    {
+      close(fd);
+      return -1;
+    }
+
+  p_rp->map_len = st.st_size;
+  p_rp->p_map = mmap(0, p_rp->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(p_rp->p_map == MAP_FAILED) return -1;
+
+  if(memcmp(p_rp->p_map, BB_REC_MAGIC, BB_REC_MAGICLEN) != 0) goto not_recording;
+
+  p_rp->catalog_len = bb_rec_get(&(p_rp->p_map[BB_REC_MAGICLEN]), 4);
+  p_rp->p_catalog = &(p_rp->p_map[BB_REC_MAGICLEN + 4]);
+  p_rp->data_start = BB_REC_MAGICLEN + 4 + p_rp->catalog_len;
+  if(p_rp->data_start > p_rp->map_len) goto not_recording;
+
+  //Use index if trailer is there & sane, otherwise records run to EOF
+  p_rp->p_index = 0;
+  p_rp->nindex = 0;
+  p_rp->data_end = p_rp->map_len;
+
+  if(p_rp->map_len >= p_rp->data_start + BB_REC_TRAILERLEN)
+    {
+      p_trailer = &(p_rp->p_map[p_rp->map_len - BB_REC_TRAILERLEN]);
+      index_offset = bb_rec_get(p_trailer, 8);
+
+      if(memcmp(&(p_trailer[12]), BB_REC_INDEX_MAGIC, 4) == 0 &&
+	 index_offset >= p_rp->data_start &&
+	 index_offset + (uint64_t)bb_rec_get(&(p_trailer[8]), 4) * BB_REC_INDEX_ENTRYLEN
+	 == p_rp->map_len - BB_REC_TRAILERLEN)
+	{
+	  p_rp->p_index = &(p_rp->p_map[index_offset]);
+	  p_rp->nindex = bb_rec_get(&(p_trailer[8]), 4);
+	  p_rp->data_end = index_offset;
+	}
+    }
+
+  p_rp->pos = p_rp->data_start;
+  return 0;
+
+ not_recording:
+  munmap(p_rp->p_map, p_rp->map_len);
+  p_rp->p_map = 0;
+  return -2;
+}
+
+void bb_replay_close(bbReplay* p_rp)
+{
+  if(p_rp->p_map != 0) munmap(p_rp->p_map, p_rp->map_len);
+  p_rp->p_map = 0;
+}
+
+// Positions replay at the first record at or after time
+void bb_replay_seek(bbReplay* p_rp, uint32_t time)
+{
+  uint32_t lo = 0;
+  uint32_t hi;
+  uint32_t mid;
+  uint64_t pos;
+  uint8_t* p_entry;
+
+  p_rp->pos = p_rp->data_start;
+
+  //Find last chunk starting before time (or the first one). Starting at
+  //or before wouldn't do: records at time may run on from earlier chunks.
+  if(p_rp->nindex > 0)
+    {
+      hi = p_rp->nindex;
+      while(hi - lo > 1)
+	{
+	  mid = lo + (hi - lo) / 2;
+	  if(bb_rec_get(&(p_rp->p_index[mid * BB_REC_INDEX_ENTRYLEN]), 4) < time)
+	    lo = mid;
+	  else
+	    hi = mid;
+	}
+
+      p_entry = &(p_rp->p_index[lo * BB_REC_INDEX_ENTRYLEN]);
+      p_rp->pos = bb_rec_get(&(p_entry[4]), 8);
+    }
+
+  //Scan forward within chunk
+  while(p_rp->pos + BB_REC_RECORD_HDRLEN <= p_rp->data_end)
+    {
+      if(bb_rec_get(&(p_rp->p_map[p_rp->pos]), 4) >= time) return;
+
+      pos = p_rp->pos + BB_REC_RECORD_HDRLEN + bb_rec_get(&(p_rp->p_map[p_rp->pos + 4]), 2);
+      p_rp->pos = pos;
+    }
+}
+
+// Gets next record, msg points into the mapped file. Returns 0 at end
+// of recording (or at a truncated record).
+uint8_t bb_replay_next(bbReplay* p_rp, uint32_t* p_time, uint8_t** pp_msg, uint16_t* p_msgLen)
+{
+  uint8_t* p_rec;
+  uint16_t msgLen;
+
+  if(p_rp->pos + BB_REC_RECORD_HDRLEN > p_rp->data_end) return 0;
+
+  p_rec = &(p_rp->p_map[p_rp->pos]);
+  msgLen = bb_rec_get(&(p_rec[4]), 2);
+  if(p_rp->pos + BB_REC_RECORD_HDRLEN + msgLen > p_rp->data_end) return 0;
+
+  *p_time = bb_rec_get(p_rec, 4);
+  *pp_msg = &(p_rec[BB_REC_RECORD_HDRLEN]);
+  *p_msgLen = msgLen;
+
+  p_rp->pos += BB_REC_RECORD_HDRLEN + msgLen;
+  return 1;
+}
+
+// Feeds records up to endTime into bb_processMessage(). If p_wait is set
+// it's called w/ the time gap before each record, for real-time (1x)
+// pacing; otherwise replay runs as fast as possible. Returns msgs played.
+uint32_t bb_replay_run(bbReplay* p_rp, bbInstance* p_bb, uint32_t endTime,
+		       void (*p_wait)(uint32_t dt))
+{
+  uint32_t time;
+  uint32_t lastTime = 0;
+  uint8_t* p_msg;
+  uint16_t msgLen;
+  uint64_t pos;
+  uint32_t count = 0;
+
+  while(1)
+    {
+      pos = p_rp->pos;
+      if(!bb_replay_next(p_rp, &time, &p_msg, &msgLen)) break;
+
+      if(time > endTime)
+	{
+	  p_rp->pos = pos;  //Leave it for next run
+	  break;
+	}
+
+      if(p_wait != 0 && count > 0 && time > lastTime)
+	p_wait(time - lastTime);
+      lastTime = time;
+
+      bb_processMessage(p_bb, p_msg, msgLen);
+      count += 1;
+    }
+
+  return count;
+}
+
+
+static void bb_rec_put(uint8_t* p_out, uint64_t val, uint8_t nbytes)
+{
+  uint8_t i;
+
+  for(i = 0; i < nbytes; i++)
+    p_out[i] = (val >> (8 * i)) & 0xff;
+}
+
+static uint64_t bb_rec_get(uint8_t* p_in, uint8_t nbytes)
+{
+  uint64_t val = 0;
+
+  while(nbytes--)
+    val = (val << 8) | p_in[nbytes];
+
+  return val;
+}
+
+
+
+#ifdef UNIT_TEST
+
+#include <time.h>  //Needed to time seeks
+
+#define TEST_NRECORDS 2000000   //~6 hours at about 90 msgs/sec
+#define TEST_PERIOD   11        //ms between records
+#define TEST_NDUPS    20000     //Records for the repeated-time seek test
+#define TEST_DUPTIME  3000      //Every record from here on has this time,
+                                //spanning several chunks
+
+uint32_t nprocessed = 0;
+uint32_t lastValue = 0;
+
+//Stand-in for babelbits.c so the test links alone
+void bb_processMessage(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  nprocessed += 1;
+  memcpy(&lastValue, &(p_msg[2]), 4);
+}
+
+void main()
+{
+  bbRecorder rec;
+  bbReplay rp;
+  uint8_t catalog[] = { BB_BATCH, 0, 2, BB_PUBLISH, 0 };
+  uint8_t msg[6] = { BB_TMPACKET, 0 };
+  uint32_t i;
+  uint32_t time;
+  uint8_t* p_msg;
+  uint16_t msgLen;
+  uint8_t result = 0;
+  clock_t start;
+
+  printf("Recording %d msgs...\n", TEST_NRECORDS);
+  if(bb_rec_open(&rec, "test.bbrec", catalog, sizeof(catalog)) != 0) result |= 0x01;
+  for(i = 0; i < TEST_NRECORDS; i++)
+    {
+      memcpy(&msg[2], &i, 4);
+      if(bb_rec_write(&rec, i * TEST_PERIOD, msg, sizeof(msg)) != 0) result |= 0x01;
+    }
+  if(bb_rec_close(&rec) != 0) result |= 0x01;
+
+  if(bb_replay_open(&rp, "test.bbrec") != 0) result |= 0x01;
+  if(rp.catalog_len != sizeof(catalog) || rp.nindex == 0) result |= 0x01;
+
+  //Seek to minute 47 & check we land on the right record
+  start = clock();
+  for(i = 0; i < 1000; i++)
+    bb_replay_seek(&rp, 47 * 60000 + i);
+  printf("Seek: %.1f us\n", 1e6 * (double)(clock() - start) / CLOCKS_PER_SEC / 1000);
+
+  bb_replay_seek(&rp, 47 * 60000);
+  if(!bb_replay_next(&rp, &time, &p_msg, &msgLen) ||
+     time != (47 * 60000 + TEST_PERIOD - 1) / TEST_PERIOD * TEST_PERIOD)
+    result |= 0x02;
+
+  //Replay one minute from there into bb_processMessage()
+  bb_replay_seek(&rp, 47 * 60000);
+  i = bb_replay_run(&rp, 0, 48 * 60000 - 1, 0);
+  if(i != nprocessed || i < 60000 / TEST_PERIOD ||
+     lastValue != (48 * 60000 - 1) / TEST_PERIOD)
+    result |= 0x04;
+
+  bb_replay_close(&rp);
+
+  //Same timestamp across several chunks, seek must land on the first one
+  if(bb_rec_open(&rec, "test.bbrec", catalog, sizeof(catalog)) != 0) result |= 0x08;
+  for(i = 0; i < TEST_NDUPS; i++)
+    {
+      memcpy(&msg[2], &i, 4);
+      time = (i < TEST_DUPTIME) ? i : TEST_DUPTIME;
+      bb_rec_write(&rec, time, msg, sizeof(msg));
+    }
+  bb_rec_close(&rec);
+
+  if(bb_replay_open(&rp, "test.bbrec") != 0 || rp.nindex < 3) result |= 0x08;
+  bb_replay_seek(&rp, TEST_DUPTIME);
+  if(!bb_replay_next(&rp, &time, &p_msg, &msgLen) || time != TEST_DUPTIME ||
+     memcmp(&(p_msg[2]), &time, 4) != 0)
+    result |= 0x08;
+  bb_replay_close(&rp);
+  remove("test.bbrec");
+
+  if( result & 0x01 )
+    printf("\nRecord & reopen:\t\t --FAILED--");
+  else
+    printf("\nRecord & reopen:\t\t --PASSED--");
+
+  if( result & 0x02 )
+    printf("\nIndexed seek:\t\t\t --FAILED--");
+  else
+    printf("\nIndexed seek:\t\t\t --PASSED--");
+
+  if( result & 0x04 )
+    printf("\nReplay into processMessage:\t --FAILED--");
+  else
+    printf("\nReplay into processMessage:\t --PASSED--");
+
+  if( result & 0x08 )
+    printf("\nSeek w/ repeated times:\t\t --FAILED--\n");
+  else
+    printf("\nSeek w/ repeated times:\t\t --PASSED--\n");
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_rec.h
+ *
+ * Description: Header file for babelbits_rec.c
+ *
+ *
+ * Test configuration: See babelbits_rec.c
+ *--------------------------------------------------------------------*/
+
+#include <stdio.h>   //Needed for FILE
+
+#define BB_REC_MAGIC "BBREC001"
+#define BB_REC_MAGICLEN 8
+#define BB_REC_INDEX_MAGIC "BBIX"
+#define BB_REC_CHUNKLEN 65536      //Bytes of records per index entry
+#define BB_REC_RECORD_HDRLEN 6     //time(4), msgLen(2)
+#define BB_REC_INDEX_ENTRYLEN 12   //time(4), offset(8)
+#define BB_REC_TRAILERLEN 16       //indexOffset(8), nindex(4), magic(4)
+
+
+//Sparse index entry: where a chunk starts & the time of its first record
+typedef struct
+{
+  uint32_t time;
+  uint64_t offset;
+} bbRecIndex;
+
+//Open recording being written
+typedef struct
+{
+  FILE* p_file;
+  uint64_t offset;          //Current end of file
+  uint32_t chunk_bytes;     //Record bytes since last index entry
+
+  bbRecIndex* p_index;      //Grows as chunks are started
+  uint32_t nindex;
+  uint32_t index_cap;
+} bbRecorder;
+
+//Recording mapped for replay
+typedef struct
+{
+  uint8_t* p_map;
+  uint64_t map_len;
+
+  uint8_t* p_catalog;       //BB_BATCH of BB_PUBLISH msgs, from header
+  uint32_t catalog_len;
+
+  uint8_t* p_index;         //Points into map, 0 if file has no index
+  uint32_t nindex;
+
+  uint64_t data_start;
+  uint64_t data_end;
+  uint64_t pos;             //Offset of next record
+} bbReplay;
+
+
+int8_t bb_rec_open(bbRecorder* p_rec, const char* p_path,
+		   uint8_t* p_catalog, uint16_t catalogLen);
+int8_t bb_rec_write(bbRecorder* p_rec, uint32_t time, uint8_t* p_msg, uint16_t msgLen);
+int8_t bb_rec_close(bbRecorder* p_rec);
+
+int8_t bb_replay_open(bbReplay* p_rp, const char* p_path);
+void bb_replay_close(bbReplay* p_rp);
+void bb_replay_seek(bbReplay* p_rp, uint32_t time);
+uint8_t bb_replay_next(bbReplay* p_rp, uint32_t* p_time, uint8_t** pp_msg, uint16_t* p_msgLen);
+uint32_t bb_replay_run(bbReplay* p_rp, bbInstance* p_bb, uint32_t endTime,
+		       void (*p_wait)(uint32_t dt));
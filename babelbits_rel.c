@@ -0,0 +1,380 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_rel.c
+ *
+ * Description: Optional reliable channel for BB messages. Sliding window
+ *              w/ sequence numbers, selective acks & retransmit timers.
+ *
+ * Message formats:
+ *
+ *       | BB_REL_DATA | seq | msg |
+ *       | BB_REL_SACK | cumAck | bitmap |
+ *
+ *    seq - 16-bit sequence number of msg
+ * cumAck - Every seq before this one has been received
+ * bitmap - Bit i set if seq cumAck+1+i has also been received
+ *
+ * All fields are big-endian. Each endpoint keeps up to `window` msgs in
+ * flight. A msg is resent when its timer runs out, or right away once a
+ * SACK shows a msg sent after it got through (it must've been lost), so
+ * one loss doesn't stall the window for a whole timeout.
+ *
+ * Usage: register handlers for BB_REL_DATA and BB_REL_SACK that pass the
+ * inner msg to bb_rel_process_data()/sack(), have p_deliver hand msgs to
+ * bb_processMessage(), and drain bb_rel_next_tx() into the link.
+ *
+ * Test configuration: uncomment "#define UNIT_TEST"
+ *                     gcc -o babelbits_rel.exe babelbits_rel.c
+ *                     run
+ *--------------------------------------------------------------------*/
+
+//#define UNIT_TEST
+
+#ifdef UNIT_TEST
+#include <stdio.h>
+#endif
+
+#include <stdint.h>  //Needed for explicit-size datatypes (uint8_t, etc)
+#include <string.h>  //Needed for memcpy
+
+#include "babelbits.h"
+#include "babelbits_rel.h"
+
+
+void bb_rel_init(bbRel* p_rel, uint8_t window, uint32_t rto,
+		 void (*p_deliver)(uint8_t* p_msg, uint16_t msgLen))
+{
+  uint8_t i;
+
+  if(window > BB_REL_WINDOW) window = BB_REL_WINDOW;
+  if(window == 0) window = 1;
+
+  p_rel->window = window;
+  p_rel->rto = rto;
+
+  p_rel->tx_base = 0;
+  p_rel->tx_next = 0;
+  p_rel->tx_count = 0;
+
+  p_rel->rx_base = 0;
+  p_rel->sack_pending = 0;
+
+  for(i = 0; i < BB_REL_WINDOW; i++)
+    {
+      p_rel->tx_slots[i].inuse = 0;
+      p_rel->rx_slots[i].inuse = 0;
+    }
+
+  p_rel->retransmits = 0;
+  p_rel->p_deliver = p_deliver;
+}
+
+
+// Queues msg for reliable delivery. Returns 0 on success, -1 if msg is
+// too long, -2 if window is full (try again once acks come in).
+int8_t bb_rel_send(bbRel* p_rel, uint8_t* p_msg, uint16_t msgLen)
+{
+  bbRelSlot* p_slot;
+
+  if(msgLen > BB_REL_MAX_MSGLEN) return -1;
+  if((uint16_t)(p_rel->tx_next - p_rel->tx_base) >= p_rel->window) return -2;
+
+  p_slot = &(p_rel->tx_slots[p_rel->tx_next % BB_REL_WINDOW]);
+  memcpy(p_slot->data, p_msg, msgLen);
+  p_slot->len = msgLen;
+  p_slot->inuse = 1;
+  p_slot->sent = 0;
+
+  p_rel->tx_next += 1;
+  return 0;
+}
+
+
+// Builds the next msg this endpoint needs to put on the link: a pending
+// SACK first, then new or timed out data. Returns its length, 0 if none.
+uint16_t bb_rel_next_tx(bbRel* p_rel, uint32_t now, uint8_t* p_out, uint16_t outLen)
+{
+  uint16_t seq;
+  uint16_t ackSeq;
+  uint32_t bitmap = 0;
+  uint8_t i;
+  bbRelSlot* p_slot;
+
+  if(p_rel->sack_pending && outLen >= BB_REL_SACK_LEN)
+    {
+      for(i = 0; i < BB_REL_WINDOW - 1; i++)
+	{
+	  ackSeq = p_rel->rx_base + 1 + i;
+	  if(p_rel->rx_slots[ackSeq % BB_REL_WINDOW].inuse)
+	    bitmap |= (uint32_t)1 << i;
+	}
+
+      p_out[0] = BB_REL_SACK;
+      p_out[1] = (p_rel->rx_base >> 8) & 0x00ff;
+      p_out[2] = p_rel->rx_base & 0x00ff;
+      p_out[3] = (bitmap >> 24) & 0x00ff;
+      p_out[4] = (bitmap >> 16) & 0x00ff;
+      p_out[5] = (bitmap >> 8) & 0x00ff;
+      p_out[6] = bitmap & 0x00ff;
+
+      p_rel->sack_pending = 0;
+      return BB_REL_SACK_LEN;
+    }
+
+  for(seq = p_rel->tx_base; seq != p_rel->tx_next; seq++)
+    {
+      p_slot = &(p_rel->tx_slots[seq % BB_REL_WINDOW]);
+      if(!p_slot->inuse) continue;  //Already selectively acked
+
+      if(p_slot->sent && now - p_slot->sent_time < p_rel->rto) continue;
+      if(BB_REL_DATA_HDRLEN + p_slot->len > outLen) return 0;
+
+      if(p_slot->sent) p_rel->retransmits += 1;  //Timed out
+
+      p_out[0] = BB_REL_DATA;
+      p_out[1] = (seq >> 8) & 0x00ff;
+      p_out[2] = seq & 0x00ff;
+      memcpy(&(p_out[BB_REL_DATA_HDRLEN]), p_slot->data, p_slot->len);
+
+      p_slot->sent = 1;
+      p_slot->sent_time = now;
+      p_slot->sent_order = p_rel->tx_count;
+      p_rel->tx_count += 1;
+
+      return BB_REL_DATA_HDRLEN + p_slot->len;
+    }
+
+  return 0;
+}
+
+
+// Handles inner msg of a BB_REL_DATA: | seq | msg |
+void bb_rel_process_data(bbRel* p_rel, uint8_t* p_msg, uint16_t msgLen)
+{
+  uint16_t seq;
+  bbRelSlot* p_slot;
+
+  if(msgLen < BB_REL_DATA_HDRLEN - 1) return;
+  msgLen -= BB_REL_DATA_HDRLEN - 1;
+  if(msgLen > BB_REL_MAX_MSGLEN) return;
+
+  seq = (p_msg[0] << 8) | p_msg[1];
+
+  //Ack everything, even duplicates--their SACK may have been lost
+  p_rel->sack_pending = 1;
+
+  //Already delivered, or too far ahead to hold
+  if((uint16_t)(seq - p_rel->rx_base) >= BB_REL_WINDOW) return;
+
+  p_slot = &(p_rel->rx_slots[seq % BB_REL_WINDOW]);
+  if(!p_slot->inuse)
+    {
+      memcpy(p_slot->data, &(p_msg[BB_REL_DATA_HDRLEN - 1]), msgLen);
+      p_slot->len = msgLen;
+      p_slot->inuse = 1;
+    }
+
+  //Deliver whatever is now in order
+  p_slot = &(p_rel->rx_slots[p_rel->rx_base % BB_REL_WINDOW]);
+  while(p_slot->inuse)
+    {
+      if(p_rel->p_deliver != 0)
+	p_rel->p_deliver(p_slot->data, p_slot->len);
+
+      p_slot->inuse = 0;
+      p_rel->rx_base += 1;
+      p_slot = &(p_rel->rx_slots[p_rel->rx_base % BB_REL_WINDOW]);
+    }
+}
+
+
+// Handles inner msg of a BB_REL_SACK: | cumAck | bitmap |
+void bb_rel_process_sack(bbRel* p_rel, uint8_t* p_msg, uint16_t msgLen)
+{
+  uint16_t cumAck;
+  uint16_t seq;
+  uint32_t bitmap;
+  uint32_t lastOrder = 0;
+  uint8_t  gotOrder = 0;
+  uint8_t i;
+  bbRelSlot* p_slot;
+
+  if(msgLen < BB_REL_SACK_LEN - 1) return;
+
+  cumAck = (p_msg[0] << 8) | p_msg[1];
+  bitmap = ((uint32_t)p_msg[2] << 24) | ((uint32_t)p_msg[3] << 16)
+         | ((uint32_t)p_msg[4] << 8)  |  (uint32_t)p_msg[5];
+
+  //Ignore acks for things we never sent
+  if((uint16_t)(cumAck - p_rel->tx_base) > (uint16_t)(p_rel->tx_next - p_rel->tx_base))
+    return;
+
+  //Free everything below cumAck
+  while(p_rel->tx_base != cumAck)
+    {
+      p_slot = &(p_rel->tx_slots[p_rel->tx_base % BB_REL_WINDOW]);
+      if(p_slot->inuse && p_slot->sent)
+	{
+	  lastOrder = p_slot->sent_order;
+	  gotOrder = 1;
+	}
+
+      p_slot->inuse = 0;
+      p_rel->tx_base += 1;
+    }
+
+  //Free selectively acked msgs above it
+  for(i = 0; i < BB_REL_WINDOW - 1; i++)
+    {
+      if(!(bitmap & ((uint32_t)1 << i))) continue;
+
+      seq = cumAck + 1 + i;
+      if((uint16_t)(seq - p_rel->tx_base) >= (uint16_t)(p_rel->tx_next - p_rel->tx_base))
+	break;
+
+      p_slot = &(p_rel->tx_slots[seq % BB_REL_WINDOW]);
+      if(p_slot->inuse && p_slot->sent)
+	{
+	  if(!gotOrder || (int32_t)(p_slot->sent_order - lastOrder) > 0)
+	    lastOrder = p_slot->sent_order;
+	  gotOrder = 1;
+	}
+      p_slot->inuse = 0;
+    }
+
+  //Anything still unacked that went out before an acked msg was lost,
+  //resend it now rather than waiting for its timer
+  if(!gotOrder) return;
+
+  for(seq = p_rel->tx_base; seq != p_rel->tx_next; seq++)
+    {
+      p_slot = &(p_rel->tx_slots[seq % BB_REL_WINDOW]);
+      if(p_slot->inuse && p_slot->sent &&
+	 (int32_t)(p_slot->sent_order - lastOrder) < 0)
+	{
+	  p_slot->sent = 0;
+	  p_rel->retransmits += 1;
+	}
+    }
+}
+
+
+// Returns 1 once everything sent has been acked & no SACK is owed
+uint8_t bb_rel_idle(bbRel* p_rel)
+{
+  return (p_rel->tx_base == p_rel->tx_next && !p_rel->sack_pending) ? 1 : 0;
+}
+
+
+
+#ifdef UNIT_TEST
+
+#include <stdlib.h>  //need rand()
+
+#define TEST_NMSGS    5000
+#define TEST_LATENCY  5      //Ticks each way, window covers ~2 round trips
+#define TEST_LOSS     10     //Percent of msgs lost each way
+#define TEST_QLEN     64
+
+//Simulated one-way link: 1 msg/tick, fixed latency, random loss
+typedef struct
+{
+  uint8_t  msgs[TEST_QLEN][BB_REL_DATA_HDRLEN + BB_REL_MAX_MSGLEN];
+  uint16_t lens[TEST_QLEN];
+  uint32_t arrive[TEST_QLEN];
+  uint16_t head, tail;
+} testLink;
+
+testLink aToB, bToA;
+bbRel relA, relB;
+
+uint32_t nextExpected = 0;
+uint8_t  orderOK = 1;
+
+void deliverB(uint8_t* p_msg, uint16_t msgLen)
+{
+  uint32_t val;
+
+  val = ((uint32_t)p_msg[0] << 24) | ((uint32_t)p_msg[1] << 16)
+      | ((uint32_t)p_msg[2] << 8)  |  (uint32_t)p_msg[3];
+  if(val != nextExpected) orderOK = 0;
+  nextExpected += 1;
+}
+
+void link_send(testLink* p_link, bbRel* p_from, uint32_t now)
+{
+  uint8_t* p_slot;
+  uint16_t len;
+
+  p_slot = p_link->msgs[p_link->tail % TEST_QLEN];
+  len = bb_rel_next_tx(p_from, now, p_slot, BB_REL_DATA_HDRLEN + BB_REL_MAX_MSGLEN);
+  if(len == 0 || rand() % 100 < TEST_LOSS) return;
+
+  p_link->lens[p_link->tail % TEST_QLEN] = len;
+  p_link->arrive[p_link->tail % TEST_QLEN] = now + TEST_LATENCY;
+  p_link->tail += 1;
+}
+
+void link_receive(testLink* p_link, bbRel* p_to, uint32_t now)
+{
+  uint8_t* p_msg;
+
+  while(p_link->head != p_link->tail && p_link->arrive[p_link->head % TEST_QLEN] <= now)
+    {
+      p_msg = p_link->msgs[p_link->head % TEST_QLEN];
+      if(p_msg[0] == BB_REL_DATA)
+	bb_rel_process_data(p_to, &(p_msg[1]), p_link->lens[p_link->head % TEST_QLEN] - 1);
+      else if(p_msg[0] == BB_REL_SACK)
+	bb_rel_process_sack(p_to, &(p_msg[1]), p_link->lens[p_link->head % TEST_QLEN] - 1);
+      p_link->head += 1;
+    }
+}
+
+void main()
+{
+  uint32_t now = 0;
+  uint32_t nsent = 0;
+  uint8_t msg[16];
+  float goodput;
+
+  printf("Running reliable channel over %d%% lossy link, %d tick latency...\n",
+	 TEST_LOSS, TEST_LATENCY);
+
+  bb_rel_init(&relA, BB_REL_WINDOW, 4 * TEST_LATENCY, 0);
+  bb_rel_init(&relB, BB_REL_WINDOW, 4 * TEST_LATENCY, &deliverB);
+  aToB.head = aToB.tail = 0;
+  bToA.head = bToA.tail = 0;
+
+  while(nextExpected < TEST_NMSGS && now < 100 * TEST_NMSGS)
+    {
+      //Keep A's window full
+      while(nsent < TEST_NMSGS)
+	{
+	  msg[0] = (nsent >> 24) & 0xff;
+	  msg[1] = (nsent >> 16) & 0xff;
+	  msg[2] = (nsent >> 8) & 0xff;
+	  msg[3] = nsent & 0xff;
+	  if(bb_rel_send(&relA, msg, sizeof(msg)) != 0) break;
+	  nsent += 1;
+	}
+
+      link_send(&aToB, &relA, now);
+      link_send(&bToA, &relB, now);
+      link_receive(&aToB, &relB, now);
+      link_receive(&bToA, &relA, now);
+      now += 1;
+    }
+
+  goodput = (float)nextExpected / now;
+  printf("Delivered %d/%d msgs in %d ticks, goodput %.2f msgs/tick, "
+	 "%d retransmits\n", nextExpected, TEST_NMSGS, now, goodput, relA.retransmits);
+  printf("Stop-and-wait would manage about %.2f msgs/tick\n",
+	 (1.0 - TEST_LOSS / 100.0) / (2 * TEST_LATENCY));
+
+  if(nextExpected == TEST_NMSGS && orderOK && goodput > 0.8)
+    printf("\nReliable delivery:\t\t --PASSED--\n");
+  else
+    printf("\nReliable delivery:\t\t --FAILED--\n");
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_rel.h
+ *
+ * Description: Header file for babelbits_rel.c
+ *
+ *
+ * Test configuration: See babelbits_rel.c
+ *--------------------------------------------------------------------*/
+
+#define BB_REL_WINDOW 32       //Max msgs in flight, also size of SACK bitmap
+#define BB_REL_MAX_MSGLEN 64   //Largest msg the reliable channel will carry
+#define BB_REL_DATA_HDRLEN 3   //msgType(1), seq(2)
+#define BB_REL_SACK_LEN 7      //msgType(1), cumAck(2), bitmap(4)
+
+
+//One msg slot. Same layout used for unacked tx msgs & out-of-order rx msgs
+typedef struct
+{
+  uint8_t  data[BB_REL_MAX_MSGLEN];
+  uint16_t len;
+  uint8_t  inuse;
+  uint8_t  sent;         //tx only: cleared when msg needs (re)transmitting
+  uint32_t sent_time;
+  uint32_t sent_order;   //tx only: value of tx_count when last sent
+} bbRelSlot;
+
+//Reliable channel endpoint. Handles both directions of one link, all in
+//fixed-size storage.
+typedef struct
+{
+  uint8_t  window;       //Configured window, <= BB_REL_WINDOW
+  uint32_t rto;          //Retransmit timeout, in user's time units
+
+  //Transmit side
+  uint16_t tx_base;      //Oldest unacked seq
+  uint16_t tx_next;      //Seq next bb_rel_send() msg will get
+  uint32_t tx_count;     //Total DATA transmissions, orders sends for SACKs
+  bbRelSlot tx_slots[BB_REL_WINDOW];
+
+  //Receive side
+  uint16_t rx_base;      //Next seq to deliver in order
+  uint8_t  sack_pending; //Got data since last SACK went out
+  bbRelSlot rx_slots[BB_REL_WINDOW];
+
+  uint32_t retransmits;  //Stats
+
+  // Called w/ each received msg, in order, exactly once
+  void (*p_deliver)(uint8_t* p_msg, uint16_t msgLen);
+} bbRel;
+
+
+void bb_rel_init(bbRel* p_rel, uint8_t window, uint32_t rto,
+		 void (*p_deliver)(uint8_t* p_msg, uint16_t msgLen));
+int8_t bb_rel_send(bbRel* p_rel, uint8_t* p_msg, uint16_t msgLen);
+uint16_t bb_rel_next_tx(bbRel* p_rel, uint32_t now, uint8_t* p_out, uint16_t outLen);
+void bb_rel_process_data(bbRel* p_rel, uint8_t* p_msg, uint16_t msgLen);
+void bb_rel_process_sack(bbRel* p_rel, uint8_t* p_msg, uint16_t msgLen);
+uint8_t bb_rel_idle(bbRel* p_rel);
@@ -0,0 +1,533 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_sched.c
+ *
+ * Description: Output scheduler for BB msgs. Queues outgoing msgs by
+ *              priority class and paces them out through a token bucket
+ *              set to the link's byte rate.
+ *
+ * Message format:
+ *
+ *       | BB_FRAGMENT | hermes_frag fragment |
+ *
+ * Bulk msgs are fragmented in the hermes_frag format (see hermes_frag.c),
+ * so the far end reassembles them w/ a hermesFragRx, in any order, and
+ * can ask for missing fragments again.
+ *
+ * The highest priority class w/ anything queued always goes next, so a
+ * critical msg only ever waits for the packet already sent plus tokens to
+ * refill. Bulk msgs longer than frag_len are sent one fragment per
+ * bb_sched_next_tx() call, so a long text dump doesn't hold up critical
+ * telemetry. The msg being fragmented is kept until the next one starts,
+ * so bb_sched_resend() can regenerate any of its fragments.
+ *
+ * Usage: after each call that leaves out_bytes_waiting set, hand the msg
+ * to bb_sched_take() w/ its class, and drain bb_sched_next_tx() into the
+ * link every tick. On the far end, register a BB_FRAGMENT handler that
+ * passes the inner msg to hermes_fragRxProcessMessage(), w/ the done
+ * handler giving the msg to bb_processMessage(). Missing fragments it
+ * reports can be sent back (e.g. as a user command) to bb_sched_resend().
+ *
+ * Test configuration: uncomment "#define UNIT_TEST"
+ *                     gcc -o babelbits_sched.exe babelbits_sched.c hermes_frag.c
+ *                     run
+ *--------------------------------------------------------------------*/
+
+//#define UNIT_TEST
+
+#ifdef UNIT_TEST
+#include <stdio.h>
+#endif
+
+#include <stdint.h>  //Needed for explicit-size datatypes (uint8_t, etc)
+#include <string.h>  //Needed for memcpy
+
+#include "babelbits.h"
+#include "hermes_frag.h"
+#include "babelbits_sched.h"
+
+
+static void bb_sched_read(bbSchedQueue* p_q, uint16_t offset, uint8_t* p_dst, uint16_t n);
+static void bb_sched_write(bbSchedQueue* p_q, uint8_t* p_src, uint16_t n);
+static uint16_t bb_sched_head_len(bbSchedQueue* p_q);
+static void bb_sched_pop(bbSchedQueue* p_q, uint16_t msgLen);
+static uint8_t bb_sched_spend(bbSched* p_sched, uint16_t pktLen);
+static uint8_t bb_sched_bulk_pending(bbSched* p_sched);
+static uint16_t bb_sched_next_bulk(bbSched* p_sched, uint8_t* p_out, uint16_t outLen);
+
+
+// Rate is bytes per per_ticks ticks, in the time units passed to
+// bb_sched_next_tx(). burst is how many bytes may go out back to back
+// after the link has been idle. max_pkt is the largest packet the link
+// takes, and the outLen bb_sched_next_tx() will be given. Bulk fragments
+// are cut to fit it. overhead is framing added to each packet by the
+// layer below (e.g. 7 for hermes w/ a 16-bit check).
+void bb_sched_init(bbSched* p_sched, uint32_t bytes, uint32_t per_ticks, uint32_t burst,
+		   uint16_t max_pkt, uint16_t frag_len, uint8_t overhead)
+{
+  uint8_t i;
+
+  for(i = 0; i < BB_SCHED_NCLASSES; i++)
+    {
+      p_sched->queues[i].head = 0;
+      p_sched->queues[i].used = 0;
+    }
+
+  if(per_ticks == 0) per_ticks = 1;
+  if(frag_len == 0) frag_len = 1;
+
+  //Bulk msgs go whole or as fragments, either way in one packet
+  if(max_pkt > BB_SCHED_FRAG_HDRLEN && frag_len > max_pkt - BB_SCHED_FRAG_HDRLEN)
+    frag_len = max_pkt - BB_SCHED_FRAG_HDRLEN;
+  else if(frag_len > max_pkt)
+    frag_len = max_pkt;
+
+  p_sched->bytes = bytes;
+  p_sched->per_ticks = per_ticks;
+  p_sched->max_tokens = (int64_t)burst * per_ticks;
+  p_sched->tokens = p_sched->max_tokens;   //Start w/ a full bucket
+  p_sched->last_time = 0;
+
+  p_sched->overhead = overhead;
+  p_sched->max_pkt = max_pkt;
+
+  p_sched->frag_len = frag_len;
+  p_sched->xfer_id = 0;
+  p_sched->xfer_held = 0;
+  p_sched->nresends = 0;
+
+  p_sched->bytes_sent = 0;
+}
+
+// Queues a msg (incl. type byte) in a priority class. Returns 0 if queued,
+// -1 if the class is full for now, -2 if prio or length is bad, which
+// includes a critical or normal msg longer than max_pkt (only bulk msgs
+// are fragmented).
+int8_t bb_sched_enqueue(bbSched* p_sched, uint8_t prio, uint8_t* p_msg, uint16_t msgLen)
+{
+  bbSchedQueue* p_q;
+  uint8_t hdr[BB_SCHED_ENTRY_HDRLEN];
+
+  if(prio >= BB_SCHED_NCLASSES || msgLen == 0 ||
+     BB_SCHED_ENTRY_HDRLEN + msgLen > BB_SCHED_QLEN) return -2;
+
+  if(prio != BB_PRIO_BULK && msgLen > p_sched->max_pkt) return -2;
+  if(prio == BB_PRIO_BULK && msgLen > p_sched->frag_len &&
+     p_sched->max_pkt <= BB_SCHED_FRAG_HDRLEN) return -2;   //No room to fragment
+
+  p_q = &(p_sched->queues[prio]);
+  if(BB_SCHED_ENTRY_HDRLEN + msgLen > BB_SCHED_QLEN - p_q->used) return -1;
+
+  hdr[0] = (msgLen >> 8) & 0x00ff;
+  hdr[1] = msgLen & 0x00ff;
+  bb_sched_write(p_q, hdr, BB_SCHED_ENTRY_HDRLEN);
+  bb_sched_write(p_q, p_msg, msgLen);
+
+  return 0;
+}
+
+// Moves the msg waiting in p_bb's out buffer into a priority class,
+// freeing the out buffer for the next one. Returns as bb_sched_enqueue(),
+// leaving the msg waiting if it couldn't be queued.
+int8_t bb_sched_take(bbSched* p_sched, bbInstance* p_bb, uint8_t prio)
+{
+  int8_t status;
+
+  if(p_bb->out_bytes_waiting == 0) return 0;
+
+  status = bb_sched_enqueue(p_sched, prio, p_bb->p_out_msgbuf, p_bb->out_bytes_waiting);
+  if(status == 0) p_bb->out_bytes_waiting = 0;
+
+  return status;
+}
+
+// Writes the next packet that should go on the link into p_out, if the
+// token bucket allows it. Returns its length, 0 if nothing's ready. A
+// packet that doesn't fit in outLen (less than max_pkt) stays queued for
+// a later call.
+uint16_t bb_sched_next_tx(bbSched* p_sched, uint32_t now, uint8_t* p_out, uint16_t outLen)
+{
+  uint8_t prio;
+  uint16_t msgLen;
+  bbSchedQueue* p_q;
+
+  //Refill bucket
+  p_sched->tokens += (int64_t)(now - p_sched->last_time) * p_sched->bytes;
+  if(p_sched->tokens > p_sched->max_tokens) p_sched->tokens = p_sched->max_tokens;
+  p_sched->last_time = now;
+
+  for(prio = 0; prio < BB_SCHED_NCLASSES; prio++)
+    if(p_sched->queues[prio].used > 0 ||
+       (prio == BB_PRIO_BULK && bb_sched_bulk_pending(p_sched))) break;
+  if(prio == BB_SCHED_NCLASSES) return 0;
+
+  if(prio == BB_PRIO_BULK) return bb_sched_next_bulk(p_sched, p_out, outLen);
+
+  p_q = &(p_sched->queues[prio]);
+  msgLen = bb_sched_head_len(p_q);
+
+  if(msgLen > outLen)
+    {
+      BB_TRACE("Error: %d byte msg won't fit in out buffer, held\n", msgLen);
+      return 0;
+    }
+
+  if(!bb_sched_spend(p_sched, msgLen)) return 0;
+
+  bb_sched_read(p_q, BB_SCHED_ENTRY_HDRLEN, p_out, msgLen);
+  bb_sched_pop(p_q, msgLen);
+  return msgLen;
+}
+
+// Bytes queued in a class, incl. per-msg headers
+uint16_t bb_sched_queued(bbSched* p_sched, uint8_t prio)
+{
+  if(prio >= BB_SCHED_NCLASSES) return 0;
+  return p_sched->queues[prio].used;
+}
+
+// Queues fragment fragIdx of a bulk transfer to be sent again, e.g. when
+// the far end's hermes_fragRxNextMissing() reports it. Resends go ahead of
+// new bulk msgs. Returns 0 if queued, -1 if too many are pending, -2 if
+// that transfer is no longer held (a newer one has started).
+int8_t bb_sched_resend(bbSched* p_sched, uint16_t xferID, uint32_t fragIdx)
+{
+  if(!p_sched->xfer_held || xferID != p_sched->frag_tx.xferID ||
+     fragIdx >= p_sched->frag_tx.nfrags) return -2;
+  if(p_sched->nresends == BB_SCHED_MAX_RESENDS) return -1;
+
+  p_sched->resends[p_sched->nresends] = fragIdx;
+  p_sched->nresends += 1;
+  return 0;
+}
+
+
+//Whether the held transfer still has fragments or resends to send
+static uint8_t bb_sched_bulk_pending(bbSched* p_sched)
+{
+  return (p_sched->nresends > 0 ||
+	  (p_sched->xfer_held && p_sched->frag_tx.nextFrag < p_sched->frag_tx.nfrags)) ? 1 : 0;
+}
+
+// Next bulk packet: a resend, the next fragment of the held transfer, or
+// else the next queued bulk msg, whole if it's short enough or as the
+// first fragment of a new transfer.
+static uint16_t bb_sched_next_bulk(bbSched* p_sched, uint8_t* p_out, uint16_t outLen)
+{
+  bbSchedQueue* p_q;
+  hermesFragTx* p_tx;
+  uint16_t msgLen;
+  uint16_t fragLen;
+  uint16_t pktLen;
+  int fragMsgLen;
+
+  p_q = &(p_sched->queues[BB_PRIO_BULK]);
+  p_tx = &(p_sched->frag_tx);
+
+  if(outLen <= BB_SCHED_FRAG_HDRLEN) return 0;
+
+  if(bb_sched_bulk_pending(p_sched))
+    {
+      //Fragments are cheap to rebuild, so build first & check tokens after.
+      //One that doesn't fit in outLen is kept for a later call.
+      p_out[0] = BB_FRAGMENT;
+      if(p_sched->nresends > 0)
+	fragMsgLen = hermes_fragTxMake(p_tx, p_sched->resends[0], &(p_out[1]), outLen - 1);
+      else
+	fragMsgLen = hermes_fragTxMake(p_tx, p_tx->nextFrag, &(p_out[1]), outLen - 1);
+
+      if(fragMsgLen <= 0 || !bb_sched_spend(p_sched, 1 + fragMsgLen)) return 0;
+
+      if(p_sched->nresends > 0)
+	{
+	  p_sched->nresends -= 1;
+	  memmove(p_sched->resends, &(p_sched->resends[1]),
+		  p_sched->nresends * sizeof(uint32_t));
+	}
+      else
+	p_tx->nextFrag += 1;
+
+      return 1 + fragMsgLen;
+    }
+
+  msgLen = bb_sched_head_len(p_q);
+
+  if(msgLen <= p_sched->frag_len && msgLen <= outLen)   //Short enough to go whole
+    {
+      if(!bb_sched_spend(p_sched, msgLen)) return 0;
+
+      bb_sched_read(p_q, BB_SCHED_ENTRY_HDRLEN, p_out, msgLen);
+      bb_sched_pop(p_q, msgLen);
+      return msgLen;
+    }
+
+  //Start a new transfer. frag_len already fits max_pkt, so every fragment
+  //fits any later call given a full sized p_out.
+  fragLen = p_sched->frag_len;
+
+  pktLen = BB_SCHED_FRAG_HDRLEN + ((msgLen < fragLen) ? msgLen : fragLen);
+  if(pktLen > outLen || !bb_sched_spend(p_sched, pktLen)) return 0;
+
+  bb_sched_read(p_q, BB_SCHED_ENTRY_HDRLEN, p_sched->bulk, msgLen);
+  bb_sched_pop(p_q, msgLen);
+
+  hermes_fragTxInit(p_tx, p_sched->xfer_id, p_sched->bulk, msgLen, fragLen);
+  p_sched->xfer_id += 1;
+  p_sched->xfer_held = 1;
+
+  p_out[0] = BB_FRAGMENT;
+  return 1 + hermes_fragTxNext(p_tx, &(p_out[1]), outLen - 1);
+}
+
+//Takes tokens for a packet if there are enough. A packet bigger than the
+//whole burst goes once the bucket is full, and leaves it in debt so the
+//average rate still holds.
+static uint8_t bb_sched_spend(bbSched* p_sched, uint16_t pktLen)
+{
+  int64_t cost;
+
+  cost = (int64_t)(pktLen + p_sched->overhead) * p_sched->per_ticks;
+  if(p_sched->tokens < ((cost < p_sched->max_tokens) ? cost : p_sched->max_tokens))
+    return 0;
+
+  p_sched->tokens -= cost;
+  p_sched->bytes_sent += pktLen + p_sched->overhead;
+  return 1;
+}
+
+//Removes the first msg, msgLen long, from a queue
+static void bb_sched_pop(bbSchedQueue* p_q, uint16_t msgLen)
+{
+  p_q->head = (p_q->head + BB_SCHED_ENTRY_HDRLEN + msgLen) % BB_SCHED_QLEN;
+  p_q->used -= BB_SCHED_ENTRY_HDRLEN + msgLen;
+}
+
+//Copies n bytes starting offset bytes past the queue head
+static void bb_sched_read(bbSchedQueue* p_q, uint16_t offset, uint8_t* p_dst, uint16_t n)
+{
+  uint16_t start;
+  uint16_t first;
+
+  start = (p_q->head + offset) % BB_SCHED_QLEN;
+  first = BB_SCHED_QLEN - start;
+  if(first > n) first = n;
+
+  memcpy(p_dst, &(p_q->bytes[start]), first);
+  memcpy(&(p_dst[first]), p_q->bytes, n - first);
+}
+
+//Appends n bytes at the queue tail. Caller checks for room.
+static void bb_sched_write(bbSchedQueue* p_q, uint8_t* p_src, uint16_t n)
+{
+  uint16_t start;
+  uint16_t first;
+
+  start = (p_q->head + p_q->used) % BB_SCHED_QLEN;
+  first = BB_SCHED_QLEN - start;
+  if(first > n) first = n;
+
+  memcpy(&(p_q->bytes[start]), p_src, first);
+  memcpy(p_q->bytes, &(p_src[first]), n - first);
+  p_q->used += n;
+}
+
+static uint16_t bb_sched_head_len(bbSchedQueue* p_q)
+{
+  uint8_t hdr[BB_SCHED_ENTRY_HDRLEN];
+
+  bb_sched_read(p_q, 0, hdr, BB_SCHED_ENTRY_HDRLEN);
+  return (hdr[0] << 8) | hdr[1];
+}
+
+
+
+#ifdef UNIT_TEST
+
+#define TEST_TICKS     20000
+#define TEST_OVERHEAD  7       //hermes header + 16-bit check
+#define TEST_FRAGLEN   32
+#define TEST_BURST     64
+#define TEST_TM_PERIOD 100     //Ticks between critical TM frames
+#define TEST_TM_LEN    12
+#define TEST_TXT_LEN   500     //Text dump is back-to-back msgs this long
+#define TEST_PUB_PERIOD 250
+#define TEST_PUB_LEN   BB_PUBLISH_MSGLEN
+#define TEST_DROP_FRAG 5       //This fragment is lost & has to be resent
+
+bbSched sched;
+hermesFragRx fragRx;
+uint8_t fragDest[TEST_TXT_LEN];
+uint8_t fragBitmap[FRAG_BITMAPLEN(TEST_TXT_LEN, TEST_FRAGLEN)];
+uint8_t pkt[BB_SCHED_QLEN];
+
+uint32_t ntxt = 0;
+uint8_t txtOK = 1;
+uint32_t nfragsRx;
+uint32_t nresent;
+
+uint32_t tmLatencyMax;
+uint32_t ntm;
+
+void deliver(uint8_t* p_msg, uint32_t msgLen)
+{
+  uint16_t i;
+
+  if(p_msg[0] != BB_TXTPACKET || msgLen != TEST_TXT_LEN) txtOK = 0;
+  for(i = 1; i < msgLen; i++)
+    if(p_msg[i] != (uint8_t)(ntxt + i)) txtOK = 0;
+  ntxt += 1;
+}
+
+//Host side. TM frames carry the tick they were queued at.
+void receive(uint8_t* p_msg, uint16_t msgLen, uint32_t now)
+{
+  uint32_t queued;
+  uint32_t lastIdx;
+
+  if(p_msg[0] == BB_FRAGMENT)
+    {
+      nfragsRx += 1;
+      if(nfragsRx == TEST_DROP_FRAG) return;
+
+      //Once the last fragment is in, ask for whatever is still missing
+      if(hermes_fragRxProcessMessage(&fragRx, &(p_msg[1]), msgLen - 1) == FRAG_ACCEPTED)
+	{
+	  lastIdx = fragRx.nfrags - 1;
+	  if(fragRx.p_bitmap[lastIdx >> 3] & (1 << (lastIdx & 0x07)) &&
+	     bb_sched_resend(&sched, fragRx.xferID,
+			     hermes_fragRxNextMissing(&fragRx, 0)) == 0)
+	    nresent += 1;
+	}
+    }
+  else if(p_msg[0] == BB_TXTPACKET)
+    deliver(p_msg, msgLen);
+  else if(p_msg[0] == BB_TMPACKET)
+    {
+      memcpy(&queued, &(p_msg[1]), sizeof(queued));
+      if(now - queued > tmLatencyMax) tmLatencyMax = now - queued;
+      ntm += 1;
+    }
+}
+
+// Runs the mixed load for TEST_TICKS. If prioritize is 0 everything goes
+// through one FIFO class, like the single out buffer did.
+void run(uint8_t prioritize)
+{
+  uint32_t now;
+  uint32_t ntxtQueued = 0;
+  uint16_t i, len;
+  uint8_t tm[TEST_TM_LEN];
+  uint8_t pub[TEST_PUB_LEN];
+  uint8_t txt[TEST_TXT_LEN];
+
+  bb_sched_init(&sched, 1, 1, TEST_BURST, sizeof(pkt), TEST_FRAGLEN, TEST_OVERHEAD);
+  hermes_fragRxInit(&fragRx, fragDest, sizeof(fragDest),
+		    fragBitmap, sizeof(fragBitmap), &deliver);
+  nfragsRx = 0;
+  nresent = 0;
+  ntxt = 0;
+  ntm = 0;
+  tmLatencyMax = 0;
+
+  memset(tm, 0, sizeof(tm));
+  memset(pub, 0, sizeof(pub));
+  tm[0] = BB_TMPACKET;
+  pub[0] = BB_PUBLISH;
+
+  for(now = 0; now < TEST_TICKS; now++)
+    {
+      if(now % TEST_TM_PERIOD == 0)
+	{
+	  memcpy(&(tm[1]), &now, sizeof(now));
+	  bb_sched_enqueue(&sched, prioritize ? BB_PRIO_CRITICAL : BB_PRIO_NORMAL,
+			   tm, sizeof(tm));
+	}
+
+      if(now % TEST_PUB_PERIOD == 0)
+	bb_sched_enqueue(&sched, BB_PRIO_NORMAL, pub, sizeof(pub));
+
+      //Text dump keeps its queue as full as it can
+      txt[0] = BB_TXTPACKET;
+      for(i = 1; i < TEST_TXT_LEN; i++)
+	txt[i] = ntxtQueued + i;
+      if(bb_sched_enqueue(&sched, prioritize ? BB_PRIO_BULK : BB_PRIO_NORMAL,
+			  txt, sizeof(txt)) == 0)
+	ntxtQueued += 1;
+
+      while((len = bb_sched_next_tx(&sched, now, pkt, sizeof(pkt))) > 0)
+	receive(pkt, len, now);
+    }
+}
+
+// Oversized normal msgs are refused at enqueue, & a packet that won't
+// fit a short p_out is held for the next call instead of lost
+uint8_t check_limits(void)
+{
+  uint8_t big[3 * TEST_FRAGLEN];
+  uint8_t ok = 1;
+  uint32_t nextFrag;
+
+  bb_sched_init(&sched, 1, 1, 1000, 64, TEST_FRAGLEN, 0);
+  memset(big, 0, sizeof(big));
+  big[0] = BB_TXTPACKET;
+
+  if(bb_sched_enqueue(&sched, BB_PRIO_NORMAL, big, 65) != -2 ||
+     bb_sched_enqueue(&sched, BB_PRIO_NORMAL, big, 64) != 0)
+    ok = 0;
+  if(bb_sched_next_tx(&sched, 0, pkt, 63) != 0 ||
+     bb_sched_next_tx(&sched, 0, pkt, 64) != 64)
+    ok = 0;
+
+  if(bb_sched_enqueue(&sched, BB_PRIO_BULK, big, sizeof(big)) != 0 ||
+     bb_sched_next_tx(&sched, 0, pkt, 64) != BB_SCHED_FRAG_HDRLEN + TEST_FRAGLEN)
+    ok = 0;
+  nextFrag = sched.frag_tx.nextFrag;
+  if(bb_sched_next_tx(&sched, 0, pkt, BB_SCHED_FRAG_HDRLEN + 4) != 0 ||
+     sched.frag_tx.nextFrag != nextFrag ||
+     bb_sched_next_tx(&sched, 0, pkt, 64) != BB_SCHED_FRAG_HDRLEN + TEST_FRAGLEN ||
+     sched.frag_tx.nextFrag != nextFrag + 1)
+    ok = 0;
+
+  return ok;
+}
+
+void main()
+{
+  uint32_t fifoMax;
+  uint32_t fifoTxt;
+  uint32_t bound;
+  uint8_t rateOK;
+
+  printf("Running TM + text dump over a 1 byte/tick link...\n");
+
+  run(0);
+  fifoMax = tmLatencyMax;
+  fifoTxt = ntxt;
+  printf("Single FIFO: %d TM frames, max latency %d ticks, %d text msgs\n",
+	 ntm, fifoMax, fifoTxt);
+
+  run(1);
+  printf("Prioritized: %d TM frames, max latency %d ticks, %d text msgs, %d resent\n",
+	 ntm, tmLatencyMax, ntxt, nresent);
+
+  //Worst case a TM frame waits out one full fragment & a publish, then
+  //its own tokens
+  bound = (BB_SCHED_FRAG_HDRLEN + TEST_FRAGLEN + TEST_OVERHEAD) +
+    (TEST_PUB_LEN + TEST_OVERHEAD) + (TEST_TM_LEN + TEST_OVERHEAD);
+  rateOK = (sched.bytes_sent <= TEST_TICKS + TEST_BURST);
+  printf("Latency bound %d ticks, %d bytes sent in %d ticks\n",
+	 bound, sched.bytes_sent, TEST_TICKS);
+
+  if(tmLatencyMax <= bound && ntm == TEST_TICKS / TEST_TM_PERIOD &&
+     txtOK && ntxt > 0 && nresent == 1 && rateOK)
+    printf("\nPriority scheduling:\t\t --PASSED--\n");
+  else
+    printf("\nPriority scheduling:\t\t --FAILED--\n");
+
+  if(check_limits())
+    printf("Packet size limits:\t\t --PASSED--\n");
+  else
+    printf("Packet size limits:\t\t --FAILED--\n");
+}
+
+#endif
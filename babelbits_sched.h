@@ -0,0 +1,72 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_sched.h
+ *
+ * Description: Header file for babelbits_sched.c
+ *
+ *
+ * Test configuration: See babelbits_sched.c
+ *--------------------------------------------------------------------*/
+
+#ifndef BB_SCHED_QLEN
+#define BB_SCHED_QLEN 1024       //Bytes of queued msgs per priority class
+#endif
+#define BB_SCHED_ENTRY_HDRLEN 2  //Length stored in front of each queued msg
+#define BB_SCHED_FRAG_HDRLEN (1 + FRAG_HEADERLEN)  //msgType + hermes_frag header
+#define BB_SCHED_MAX_RESENDS 8   //Fragment resend requests held at once
+
+//Highest priority first
+enum bbPriority
+  {
+    BB_PRIO_CRITICAL,     //e.g. TM frames, never fragmented
+    BB_PRIO_NORMAL,       //e.g. publishes & acks, never fragmented
+    BB_PRIO_BULK,         //e.g. text dumps, fragmented w/ hermes_frag
+    BB_SCHED_NCLASSES
+  };
+
+//FIFO of length-prefixed msgs for one class
+typedef struct
+{
+  uint8_t  bytes[BB_SCHED_QLEN];
+  uint16_t head;         //Offset of first queued byte
+  uint16_t used;         //Bytes queued
+} bbSchedQueue;
+
+//Output scheduler. Strict priority between classes, all sharing one token
+//bucket so the link byte rate is never exceeded.
+typedef struct
+{
+  bbSchedQueue queues[BB_SCHED_NCLASSES];
+
+  //Token bucket, scaled by per_ticks so everything stays integer
+  uint32_t bytes;        //Rate is bytes per per_ticks ticks
+  uint32_t per_ticks;
+  int64_t  tokens;        //Goes negative after a packet bigger than the burst
+  int64_t  max_tokens;    //Burst allowance
+  uint32_t last_time;
+
+  uint8_t  overhead;     //Framing bytes added per packet (e.g. hermes header)
+  uint16_t max_pkt;      //Largest packet the link takes, outLen for next_tx
+
+  //Bulk msg being fragmented. It's moved out of the queue so it stays
+  //whole for resends until the next one starts.
+  uint16_t frag_len;     //Max payload of a bulk fragment
+  uint16_t xfer_id;      //Given to the next transfer
+  uint8_t  xfer_held;    //Set while frag_tx/bulk are a valid transfer
+  hermesFragTx frag_tx;
+  uint8_t  bulk[BB_SCHED_QLEN];
+
+  uint32_t resends[BB_SCHED_MAX_RESENDS];  //Fragment indices to resend
+  uint8_t  nresends;
+
+  uint32_t bytes_sent;   //Stats, incl. overhead
+} bbSched;
+
+
+void bb_sched_init(bbSched* p_sched, uint32_t bytes, uint32_t per_ticks, uint32_t burst,
+		   uint16_t max_pkt, uint16_t frag_len, uint8_t overhead);
+int8_t bb_sched_enqueue(bbSched* p_sched, uint8_t prio, uint8_t* p_msg, uint16_t msgLen);
+int8_t bb_sched_take(bbSched* p_sched, bbInstance* p_bb, uint8_t prio);
+uint16_t bb_sched_next_tx(bbSched* p_sched, uint32_t now, uint8_t* p_out, uint16_t outLen);
+uint16_t bb_sched_queued(bbSched* p_sched, uint8_t prio);
+int8_t bb_sched_resend(bbSched* p_sched, uint16_t xferID, uint32_t fragIdx);
@@ -0,0 +1,422 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_sim.c
+ *
+ * Description: Deterministic in-process link simulator. Sits between a
+ *              "device" and a "host" endpoint and models bandwidth,
+ *              latency, bit errors, burst drops & byte duplication.
+ *
+ * Usage: each endpoint writes the bytes it would put on the wire (e.g.
+ * hermes_makePacket() output) w/ bb_sim_write(), and gets bytes from the
+ * far end through its p_rx callback (e.g. into hermes_processChar()).
+ * Call bb_sim_step() as simulated time advances. To measure goodput, loss
+ * & latency, tag packets w/ bb_sim_tx_packet() when sending and
+ * bb_sim_rx_packet() when a good one comes out the far end, then call
+ * bb_sim_report().
+ *
+ * All randomness comes from the seed given to bb_sim_init(), so a run
+ * can be repeated exactly.
+ *
+ * Test configuration: uncomment "#define UNIT_TEST"
+ *                     gcc -c -Dmain=hermes_main hermes.c
+ *                     gcc -c -Dmain=bb_main babelbits.c
+ *                     gcc -o babelbits_sim.exe babelbits_sim.c hermes.o babelbits.o
+ *                     run
+ *                     (hermes.c & babelbits.c build their own tests in,
+ *                     so their mains are renamed out of the way)
+ *--------------------------------------------------------------------*/
+
+//#define UNIT_TEST
+
+#ifdef UNIT_TEST
+#include <stdio.h>
+#endif
+
+#include <stdint.h>  //Needed for explicit-size datatypes (uint8_t, etc)
+#include <stdlib.h>  //Needed for qsort
+#include <string.h>  //Needed for memset
+
+#include "babelbits_sim.h"
+
+#ifdef UNIT_TEST
+#include "hermes.h"
+#include "babelbits.h"
+#endif
+
+
+static uint32_t bb_sim_rand(bbSim* p_sim);
+static double bb_sim_uniform(bbSim* p_sim);
+static int bb_sim_cmp_u32(const void* p_a, const void* p_b);
+
+
+void bb_sim_init(bbSim* p_sim, uint32_t seed)
+{
+  memset(p_sim, 0, sizeof(bbSim));
+
+  p_sim->rng = (seed != 0) ? seed : 0x2545f491;  //xorshift can't start at 0
+}
+
+void bb_sim_configure(bbSim* p_sim, uint8_t dir, bbSimParams* p_params,
+		      void (*p_rx)(void* p_ctx, uint8_t c), void* p_ctx)
+{
+  bbSimChannel* p_chan;
+
+  p_chan = &(p_sim->dirs[dir]);
+
+  p_chan->params = *p_params;
+  p_chan->p_rx = p_rx;
+  p_chan->p_ctx = p_ctx;
+}
+
+
+// Puts bytes on the link at time now. Returns how many were accepted
+// (lost ones count as accepted, only a full queue refuses bytes).
+uint16_t bb_sim_write(bbSim* p_sim, uint8_t dir, uint8_t* p_bytes, uint16_t nbytes,
+		      uint32_t now)
+{
+  bbSimChannel* p_chan;
+  bbSimParams* p_par;
+  uint16_t i;
+  uint8_t bit;
+  uint8_t c;
+  uint8_t copies;
+
+  p_chan = &(p_sim->dirs[dir]);
+  p_par = &(p_chan->params);
+
+  for(i = 0; i < nbytes; i++)
+    {
+      c = p_bytes[i];
+      p_chan->stats.bytes_offered += 1;
+
+      //Byte occupies the line whether or not it survives
+      if((int32_t)(p_chan->line_free - now) < 0) p_chan->line_free = now;
+      p_chan->line_free += p_par->ticks_per_byte;
+
+      //Burst drops: two-state channel, bursts last burst_len bytes on avg
+      if(p_chan->in_burst)
+	{
+	  if(p_par->burst_len == 0 || bb_sim_uniform(p_sim) < 1.0 / p_par->burst_len)
+	    p_chan->in_burst = 0;
+	}
+      else if(p_par->burst_prob > 0 && bb_sim_uniform(p_sim) < p_par->burst_prob)
+	p_chan->in_burst = 1;
+
+      if(p_chan->in_burst)
+	{
+	  p_chan->stats.bytes_dropped += 1;
+	  continue;
+	}
+
+      if(p_par->bit_error_rate > 0)
+	{
+	  for(bit = 0; bit < 8; bit++)
+	    if(bb_sim_uniform(p_sim) < p_par->bit_error_rate)
+	      c ^= 1 << bit;
+
+	  if(c != p_bytes[i]) p_chan->stats.bytes_corrupted += 1;
+	}
+
+      copies = 1;
+      if(p_par->dup_prob > 0 && bb_sim_uniform(p_sim) < p_par->dup_prob)
+	{
+	  copies = 2;
+	  p_chan->stats.bytes_duplicated += 1;
+	}
+
+      while(copies--)
+	{
+	  if(p_chan->tail - p_chan->head >= BB_SIM_QLEN)
+	    {
+	      p_chan->stats.bytes_overflowed += 1;
+	      return i;
+	    }
+
+	  p_chan->bytes[p_chan->tail % BB_SIM_QLEN] = c;
+	  p_chan->arrive[p_chan->tail % BB_SIM_QLEN] = p_chan->line_free + p_par->latency;
+	  p_chan->tail += 1;
+	}
+    }
+
+  return nbytes;
+}
+
+// Delivers every byte due by time now to the far end, in order
+void bb_sim_step(bbSim* p_sim, uint32_t now)
+{
+  bbSimChannel* p_chan;
+  uint8_t dir;
+  uint8_t c;
+
+  for(dir = 0; dir < BB_SIM_NDIRS; dir++)
+    {
+      p_chan = &(p_sim->dirs[dir]);
+
+      while(p_chan->head != p_chan->tail &&
+	    (int32_t)(p_chan->arrive[p_chan->head % BB_SIM_QLEN] - now) <= 0)
+	{
+	  c = p_chan->bytes[p_chan->head % BB_SIM_QLEN];
+	  p_chan->head += 1;
+
+	  if(p_chan->p_rx != 0) p_chan->p_rx(p_chan->p_ctx, c);
+	}
+    }
+}
+
+
+// Sender calls this as it writes a packet it wants measured
+void bb_sim_tx_packet(bbSim* p_sim, uint8_t dir, uint16_t tag, uint32_t now)
+{
+  bbSimChannel* p_chan;
+
+  p_chan = &(p_sim->dirs[dir]);
+
+  if(p_chan->stats.packets_sent == 0) p_chan->stats.first_tx_time = now;
+  p_chan->stats.packets_sent += 1;
+
+  p_chan->tag_time[tag % BB_SIM_MAX_TAGS] = now;
+  p_chan->tag_valid[tag % BB_SIM_MAX_TAGS] = 1;
+}
+
+// Receiver calls this for each tagged packet that arrives intact.
+// Duplicates of a packet already counted are ignored.
+void bb_sim_rx_packet(bbSim* p_sim, uint8_t dir, uint16_t tag, uint16_t payloadLen,
+		      uint32_t now)
+{
+  bbSimChannel* p_chan;
+  bbSimStats* p_stats;
+
+  p_chan = &(p_sim->dirs[dir]);
+  p_stats = &(p_chan->stats);
+
+  if(!p_chan->tag_valid[tag % BB_SIM_MAX_TAGS]) return;
+  p_chan->tag_valid[tag % BB_SIM_MAX_TAGS] = 0;
+
+  p_stats->packets_received += 1;
+  p_stats->payload_bytes_received += payloadLen;
+
+  p_stats->latencies[p_stats->nlatencies % BB_SIM_MAX_SAMPLES] =
+    now - p_chan->tag_time[tag % BB_SIM_MAX_TAGS];
+  p_stats->nlatencies += 1;
+}
+
+void bb_sim_report(bbSim* p_sim, uint8_t dir, uint32_t now, bbSimReport* p_report)
+{
+  static uint32_t sorted[BB_SIM_MAX_SAMPLES];
+  bbSimStats* p_stats;
+  uint32_t n;
+
+  p_stats = &(p_sim->dirs[dir].stats);
+  memset(p_report, 0, sizeof(bbSimReport));
+
+  if(p_stats->packets_sent == 0) return;
+
+  if(now != p_stats->first_tx_time)
+    p_report->goodput = (double)p_stats->payload_bytes_received /
+                        (now - p_stats->first_tx_time);
+  p_report->loss = 1.0 - (double)p_stats->packets_received / p_stats->packets_sent;
+
+  n = p_stats->nlatencies;
+  if(n > BB_SIM_MAX_SAMPLES) n = BB_SIM_MAX_SAMPLES;
+  if(n == 0) return;
+
+  memcpy(sorted, p_stats->latencies, n * sizeof(uint32_t));
+  qsort(sorted, n, sizeof(uint32_t), &bb_sim_cmp_u32);
+
+  p_report->latency_p50 = sorted[(n - 1) * 50 / 100];
+  p_report->latency_p90 = sorted[(n - 1) * 90 / 100];
+  p_report->latency_p99 = sorted[(n - 1) * 99 / 100];
+  p_report->latency_max = sorted[n - 1];
+}
+
+
+static uint32_t bb_sim_rand(bbSim* p_sim)
+{
+  uint32_t x = p_sim->rng;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+
+  p_sim->rng = x;
+  return x;
+}
+
+//Uniform on [0, 1)
+static double bb_sim_uniform(bbSim* p_sim)
+{
+  return (bb_sim_rand(p_sim) >> 8) * (1.0 / 16777216.0);
+}
+
+static int bb_sim_cmp_u32(const void* p_a, const void* p_b)
+{
+  uint32_t a = *(const uint32_t*)p_a;
+  uint32_t b = *(const uint32_t*)p_b;
+
+  return (a > b) - (a < b);
+}
+
+
+
+#ifdef UNIT_TEST
+
+#define TEST_NPACKETS   2000
+#define TEST_PERIOD     500   //Ticks between packets
+#define TEST_INBUFLEN   128   //hermes rejects longer packets, bounding a resync
+
+//Device sends real TM frames through hermes, host parses them w/
+//hermes_processChar() & its own bbInstance. The frame's seq field is
+//the simulator tag.
+bbSim* p_testSim;
+uint32_t testNow;
+uint8_t testFlushing;
+
+bbInstance simDev;
+bbInstance simHost;
+uint8_t simDevBuf[64];
+uint8_t simHostBuf[64];
+uint8_t simInBuf[TEST_INBUFLEN];
+uint8_t simOutBuf[TEST_INBUFLEN];
+
+uint16_t simSeq;
+uint32_t simCount;
+float simLevel;
+
+void host_tm(bbInstance* p_bb, uint8_t* p_msg, uint16_t msgLen)
+{
+  uint16_t seq;
+
+  //seq is field 0, so it leads every frame
+  if(msgLen < 1 + sizeof(seq) || p_msg[0] != 0) return;
+
+  memcpy(&seq, &(p_msg[1]), sizeof(seq));
+  bb_sim_rx_packet(p_testSim, BB_SIM_DEVICE_TO_HOST, seq, 1 + msgLen, testNow);
+}
+
+void host_msg(uint8_t* p_msg, uint16_t msgLen)
+{
+  if(!testFlushing) bb_processMessage(&simHost, p_msg, msgLen);
+}
+
+void host_rx(void* p_ctx, uint8_t c)
+{
+  hermes_processChar(c);
+}
+
+// Sends one TM frame tagged w/ seq. Returns its length on the wire.
+uint16_t dev_send(bbSim* p_sim, uint16_t seq, uint32_t now)
+{
+  uint8_t packet[TEST_INBUFLEN];
+  int len;
+
+  simSeq = seq;
+  simCount = seq * 7;
+  simLevel = seq * 0.5f;
+  if(bb_send_tmpacket(&simDev) <= 0) return 0;
+
+  len = hermes_makePacket(CHECKSUM16, simDev.p_out_msgbuf, simDev.out_bytes_waiting, packet);
+  simDev.out_bytes_waiting = 0;
+
+  bb_sim_tx_packet(p_sim, BB_SIM_DEVICE_TO_HOST, seq, now);
+  bb_sim_write(p_sim, BB_SIM_DEVICE_TO_HOST, packet, len, now);
+  return len;
+}
+
+// Returns the length of each packet on the wire
+uint16_t run_link(bbSim* p_sim, bbSimParams* p_params, uint32_t seed, bbSimReport* p_report)
+{
+  uint8_t sub[2] = { BB_SUBSCRIBE, 0 };
+  uint32_t now;
+  uint16_t tag = 0;
+  uint16_t packetLen = 0;
+  uint16_t i;
+
+  //A lossy run can leave hermes partway into a bogus packet. It can't be
+  //longer than the in buffer, so that many non-sync bytes resets it.
+  testFlushing = 1;
+  for(i = 0; i < TEST_INBUFLEN; i++)
+    hermes_processChar(0);
+  testFlushing = 0;
+
+  bb_init(&simDev, simDevBuf, sizeof(simDevBuf));
+  bb_register_field(&simDev, &simSeq, UINT16, "seq");
+  bb_register_field(&simDev, &simCount, UINT32, "count");
+  bb_register_field(&simDev, &simLevel, FLOAT32, "level");
+  for(sub[1] = 0; sub[1] < 3; sub[1]++)
+    bb_processMessage(&simDev, sub, sizeof(sub));
+
+  bb_init(&simHost, simHostBuf, sizeof(simHostBuf));
+  bb_register_handler(&simHost, BB_TMPACKET, &host_tm);
+
+  bb_sim_init(p_sim, seed);
+  bb_sim_configure(p_sim, BB_SIM_DEVICE_TO_HOST, p_params, &host_rx, 0);
+  p_testSim = p_sim;
+
+  for(now = 0; now < TEST_NPACKETS * TEST_PERIOD + 10000; now++)
+    {
+      if(now % TEST_PERIOD == 0 && tag < TEST_NPACKETS)
+	{
+	  packetLen = dev_send(p_sim, tag, now);
+	  tag += 1;
+	}
+
+      testNow = now;
+      bb_sim_step(p_sim, now);
+    }
+
+  bb_sim_report(p_sim, BB_SIM_DEVICE_TO_HOST, now, p_report);
+  return packetLen;
+}
+
+void print_report(char* p_name, bbSimReport* p_report)
+{
+  printf("%-8s goodput %.4f B/tick  loss %5.2f%%  latency p50 %d p90 %d p99 %d max %d\n",
+	 p_name, p_report->goodput, 100.0 * p_report->loss, p_report->latency_p50,
+	 p_report->latency_p90, p_report->latency_p99, p_report->latency_max);
+}
+
+bbSim sim;
+
+void main()
+{
+  bbSimParams clean = { 10, 1000, 0.0, 0.0, 0, 0.0 };
+  bbSimParams noisy = { 10, 1000, 1e-4, 1e-4, 20, 1e-4 };
+  bbSimReport cleanReport, noisyReport, repeatReport;
+  uint16_t packetLen;
+  uint32_t wireTime;
+
+  printf("Running %d TM frames through hermes & simulated links...\n", TEST_NPACKETS);
+
+  hermes_init(simInBuf, sizeof(simInBuf), simOutBuf, sizeof(simOutBuf), &host_msg);
+
+  packetLen = run_link(&sim, &clean, 1, &cleanReport);
+  wireTime = packetLen * clean.ticks_per_byte + clean.latency;
+  print_report("clean", &cleanReport);
+
+  run_link(&sim, &noisy, 1, &noisyReport);
+  print_report("noisy", &noisyReport);
+
+  run_link(&sim, &noisy, 1, &repeatReport);
+
+  //Clean link: nothing lost, every packet takes serialization + latency
+  if(packetLen > 0 && cleanReport.loss == 0.0 &&
+     cleanReport.latency_p50 == wireTime && cleanReport.latency_max == wireTime)
+    printf("\nClean link model:\t\t --PASSED--");
+  else
+    printf("\nClean link model:\t\t --FAILED--");
+
+  //Impaired link: some frames lost, but any that get through intact
+  //weren't held up
+  if(noisyReport.loss > 0.0 && noisyReport.loss < 0.5 &&
+     noisyReport.latency_p99 == wireTime)
+    printf("\nImpaired link model:\t\t --PASSED--");
+  else
+    printf("\nImpaired link model:\t\t --FAILED--");
+
+  if(memcmp(&noisyReport, &repeatReport, sizeof(bbSimReport)) == 0)
+    printf("\nSeeded runs repeat exactly:\t --PASSED--\n");
+  else
+    printf("\nSeeded runs repeat exactly:\t --FAILED--\n");
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_sim.h
+ *
+ * Description: Header file for babelbits_sim.c
+ *
+ *
+ * Test configuration: See babelbits_sim.c
+ *--------------------------------------------------------------------*/
+
+#define BB_SIM_QLEN 8192         //Max bytes in flight in each direction
+#define BB_SIM_MAX_TAGS 1024     //Max tagged packets in flight per direction
+#define BB_SIM_MAX_SAMPLES 4096  //Latency samples kept for percentiles
+
+enum bbSimDirection
+  {
+    BB_SIM_DEVICE_TO_HOST,
+    BB_SIM_HOST_TO_DEVICE,
+    BB_SIM_NDIRS
+  };
+
+//Channel model for one direction. Times are in ticks, whatever unit the
+//user steps the simulator in.
+typedef struct
+{
+  uint32_t ticks_per_byte;     //Serialization time, sets bandwidth
+  uint32_t latency;            //Propagation delay added to every byte
+  double   bit_error_rate;     //Chance each bit gets flipped
+  double   burst_prob;         //Chance per byte that a drop burst starts
+  uint32_t burst_len;          //Mean bytes dropped per burst
+  double   dup_prob;           //Chance per byte it's delivered twice
+} bbSimParams;
+
+typedef struct
+{
+  uint32_t bytes_offered;
+  uint32_t bytes_dropped;      //Lost in bursts
+  uint32_t bytes_overflowed;   //Lost because queue was full
+  uint32_t bytes_corrupted;
+  uint32_t bytes_duplicated;
+
+  uint32_t packets_sent;
+  uint32_t packets_received;
+  uint32_t payload_bytes_received;
+  uint32_t first_tx_time;
+
+  uint32_t latencies[BB_SIM_MAX_SAMPLES];  //Most recent packet latencies
+  uint32_t nlatencies;         //Total samples taken, may exceed array
+} bbSimStats;
+
+typedef struct
+{
+  double   goodput;            //Payload bytes delivered per tick
+  double   loss;               //Fraction of tagged packets not received
+  uint32_t latency_p50;
+  uint32_t latency_p90;
+  uint32_t latency_p99;
+  uint32_t latency_max;
+} bbSimReport;
+
+typedef struct
+{
+  bbSimParams params;
+
+  uint8_t  bytes[BB_SIM_QLEN];
+  uint32_t arrive[BB_SIM_QLEN];
+  uint32_t head, tail;
+  uint32_t line_free;          //When link finishes sending last byte
+  uint8_t  in_burst;
+
+  uint32_t tag_time[BB_SIM_MAX_TAGS];
+  uint8_t  tag_valid[BB_SIM_MAX_TAGS];
+
+  // Called w/ each byte as it comes out the far end
+  void (*p_rx)(void* p_ctx, uint8_t c);
+  void* p_ctx;
+
+  bbSimStats stats;
+} bbSimChannel;
+
+typedef struct
+{
+  uint32_t rng;                //xorshift32 state, seeded by bb_sim_init()
+  bbSimChannel dirs[BB_SIM_NDIRS];
+} bbSim;
+
+
+void bb_sim_init(bbSim* p_sim, uint32_t seed);
+void bb_sim_configure(bbSim* p_sim, uint8_t dir, bbSimParams* p_params,
+		      void (*p_rx)(void* p_ctx, uint8_t c), void* p_ctx);
+uint16_t bb_sim_write(bbSim* p_sim, uint8_t dir, uint8_t* p_bytes, uint16_t nbytes,
+		      uint32_t now);
+void bb_sim_step(bbSim* p_sim, uint32_t now);
+void bb_sim_tx_packet(bbSim* p_sim, uint8_t dir, uint16_t tag, uint32_t now);
+void bb_sim_rx_packet(bbSim* p_sim, uint8_t dir, uint16_t tag, uint16_t payloadLen,
+		      uint32_t now);
+void bb_sim_report(bbSim* p_sim, uint8_t dir, uint32_t now, bbSimReport* p_report);
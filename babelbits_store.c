@@ -0,0 +1,581 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_store.c
+ *
+ * Description: Host-side in-memory time-series store for received TM.
+ *              Keeps each field of each link as its own columns of
+ *              timestamps & typed values.
+ *
+ * Layout:
+ *
+ *    store -> series (one per link & field_id) -> chunks, oldest first
+ *    chunk -> | summary | times[BB_STORE_CHUNKLEN] | values |
+ *
+ * Values are stored at their type's size, in native byte order, exactly
+ * as they came out of the TM frame. Chunks are ordered by time, so a
+ * query binary searches the chunk list & then the times in one chunk.
+ * Each chunk keeps min/max/sum of its values, so aggregates only scan the
+ * partial chunks at either end of the range. Samples of a series must be
+ * appended in time order.
+ *
+ * Usage: feed each BB_TMPACKET's inner msg, w/ the link it came from &
+ * its receive time, to bb_store_tmpacket(), or call bb_store_append()
+ * for values from elsewhere (e.g. bb_decode_tmpacked()).
+ *
+ * Test configuration: uncomment "#define UNIT_TEST"
+ *                     gcc -o babelbits_store.exe babelbits_store.c
+ *                     run
+ *--------------------------------------------------------------------*/
+
+//#define UNIT_TEST
+
+#ifdef UNIT_TEST
+#include <stdio.h>
+#endif
+
+#include <stdint.h>  //Needed for explicit-size datatypes (uint8_t, etc)
+#include <stdlib.h>  //Needed for malloc
+#include <string.h>  //Needed for memcpy
+
+#include "babelbits.h"
+#include "babelbits_store.h"
+
+
+static double bb_store_get(uint8_t type, const uint8_t* p_values, uint32_t i);
+static void bb_store_scan(bbStoreSeries* p_series, bbStoreChunk* p_chunk,
+			  uint32_t i0, uint32_t i1, bbStoreAgg* p_agg, double* p_sum);
+static uint32_t bb_store_first_chunk(bbStoreSeries* p_series, uint32_t t0);
+static uint32_t bb_store_first_sample(bbStoreChunk* p_chunk, uint32_t t0);
+
+
+// retention is in the same time units samples are stamped w/, 0 for no
+// limit. max_samples is per series, 0 for no limit. Limits are checked as
+// each chunk is started & only whole chunks are freed, so a series can
+// hold up to two chunks more than asked.
+void bb_store_init(bbStore* p_store, uint32_t retention, uint64_t max_samples)
+{
+  p_store->p_series = 0;
+  p_store->nseries = 0;
+  p_store->series_cap = 0;
+  p_store->p_map = 0;
+  p_store->map_len = 0;
+  p_store->retention = retention;
+  p_store->max_samples = max_samples;
+}
+
+void bb_store_free(bbStore* p_store)
+{
+  uint32_t i, c;
+
+  for(i = 0; i < p_store->nseries; i++)
+    {
+      for(c = 0; c < p_store->p_series[i].nchunks; c++)
+	free(p_store->p_series[i].p_chunks[c]);
+      free(p_store->p_series[i].p_chunks);
+    }
+
+  free(p_store->p_series);
+  free(p_store->p_map);
+  bb_store_init(p_store, p_store->retention, p_store->max_samples);
+}
+
+// Returns the series for a link's field, creating it if needed, or
+// BB_STORE_NO_SERIES if it exists w/ another type or memory ran out.
+uint32_t bb_store_series(bbStore* p_store, uint16_t link, uint8_t field_id, uint8_t type)
+{
+  uint32_t key;
+  uint32_t newLen;
+  uint32_t series;
+  void* p_new;
+  bbStoreSeries* p_series;
+
+  series = bb_store_find(p_store, link, field_id);
+  if(series != BB_STORE_NO_SERIES)
+    return (p_store->p_series[series].type == type) ? series : BB_STORE_NO_SERIES;
+
+  if(bb_type_size(type) == 0 || field_id >= BB_MAX_NFIELDS) return BB_STORE_NO_SERIES;
+
+  key = (uint32_t)link * BB_MAX_NFIELDS + field_id;
+  if(key >= p_store->map_len)
+    {
+      newLen = (link + 1) * BB_MAX_NFIELDS;
+      p_new = realloc(p_store->p_map, newLen * sizeof(uint32_t));
+      if(p_new == 0) return BB_STORE_NO_SERIES;
+
+      p_store->p_map = p_new;
+      memset(&(p_store->p_map[p_store->map_len]), 0,
+	     (newLen - p_store->map_len) * sizeof(uint32_t));
+      p_store->map_len = newLen;
+    }
+
+  if(p_store->nseries == p_store->series_cap)
+    {
+      newLen = (p_store->series_cap == 0) ? 16 : 2 * p_store->series_cap;
+      p_new = realloc(p_store->p_series, newLen * sizeof(bbStoreSeries));
+      if(p_new == 0) return BB_STORE_NO_SERIES;
+
+      p_store->p_series = p_new;
+      p_store->series_cap = newLen;
+    }
+
+  series = p_store->nseries;
+  p_series = &(p_store->p_series[series]);
+  p_series->link = link;
+  p_series->field_id = field_id;
+  p_series->type = type;
+  p_series->size = bb_type_size(type);
+  p_series->p_chunks = 0;
+  p_series->nchunks = 0;
+  p_series->chunks_cap = 0;
+  p_series->nsamples = 0;
+
+  p_store->nseries += 1;
+  p_store->p_map[key] = series + 1;
+
+  return series;
+}
+
+// Returns the series for a link's field, or BB_STORE_NO_SERIES
+uint32_t bb_store_find(bbStore* p_store, uint16_t link, uint8_t field_id)
+{
+  uint32_t key;
+
+  key = (uint32_t)link * BB_MAX_NFIELDS + field_id;
+  if(field_id >= BB_MAX_NFIELDS || key >= p_store->map_len || p_store->p_map[key] == 0)
+    return BB_STORE_NO_SERIES;
+
+  return p_store->p_map[key] - 1;
+}
+
+// Appends a sample, p_value in the series' type. Returns 0 if stored, -1
+// if out of memory, -2 if it's older than the last sample.
+int8_t bb_store_append(bbStore* p_store, uint32_t series, uint32_t time, const void* p_value)
+{
+  bbStoreSeries* p_series;
+  bbStoreChunk* p_chunk = 0;
+  uint32_t newLen;
+  void* p_new;
+  double value;
+
+  if(series >= p_store->nseries) return -1;
+  p_series = &(p_store->p_series[series]);
+
+  if(p_series->nchunks > 0)
+    {
+      p_chunk = p_series->p_chunks[p_series->nchunks - 1];
+      if(time < p_chunk->t_last) return -2;
+      if(p_chunk->n == BB_STORE_CHUNKLEN) p_chunk = 0;
+    }
+
+  if(p_chunk == 0)  //Start a new chunk, reusing the oldest if it's expired
+    {
+      while(p_series->nchunks > 0 &&
+	    ((p_store->retention > 0 &&
+	      time - p_series->p_chunks[0]->t_last > p_store->retention) ||
+	     (p_store->max_samples > 0 &&
+	      p_series->nsamples - p_series->p_chunks[0]->n >= p_store->max_samples)))
+	{
+	  free(p_chunk);
+	  p_chunk = p_series->p_chunks[0];
+	  p_series->nsamples -= p_chunk->n;
+	  p_series->nchunks -= 1;
+	  memmove(p_series->p_chunks, &(p_series->p_chunks[1]),
+		  p_series->nchunks * sizeof(bbStoreChunk*));
+	}
+
+      if(p_chunk == 0)
+	{
+	  p_chunk = malloc(sizeof(bbStoreChunk) + BB_STORE_CHUNKLEN * p_series->size);
+	  if(p_chunk == 0) return -1;
+	}
+
+      if(p_series->nchunks == p_series->chunks_cap)
+	{
+	  newLen = (p_series->chunks_cap == 0) ? 16 : 2 * p_series->chunks_cap;
+	  p_new = realloc(p_series->p_chunks, newLen * sizeof(bbStoreChunk*));
+	  if(p_new == 0)
+	    {
+	      free(p_chunk);
+	      return -1;
+	    }
+
+	  p_series->p_chunks = p_new;
+	  p_series->chunks_cap = newLen;
+	}
+
+      p_chunk->n = 0;
+      p_chunk->t_first = time;
+      p_series->p_chunks[p_series->nchunks] = p_chunk;
+      p_series->nchunks += 1;
+    }
+
+  p_chunk->times[p_chunk->n] = time;
+  memcpy(&(p_chunk->values[p_chunk->n * p_series->size]), p_value, p_series->size);
+
+  value = bb_store_get(p_series->type, p_chunk->values, p_chunk->n);
+  if(p_chunk->n == 0)
+    {
+      p_chunk->min = value;
+      p_chunk->max = value;
+      p_chunk->sum = value;
+    }
+  else
+    {
+      if(value < p_chunk->min) p_chunk->min = value;
+      if(value > p_chunk->max) p_chunk->max = value;
+      p_chunk->sum += value;
+    }
+
+  p_chunk->t_last = time;
+  p_chunk->n += 1;
+  p_series->nsamples += 1;
+
+  return 0;
+}
+
+// Stores every value in a BB_TMPACKET inner msg (| field_id | value | ...),
+// typed by the link's catalog. Returns number of values stored, or -1 if
+// the frame doesn't match the catalog.
+int16_t bb_store_tmpacket(bbStore* p_store, uint16_t link, bbCatalog* p_cat, uint32_t time,
+			  uint8_t* p_msg, uint16_t msgLen)
+{
+  uint16_t i = 0;
+  uint8_t field_id;
+  uint8_t size;
+  uint32_t series;
+  int16_t count = 0;
+
+  while(i < msgLen)
+    {
+      field_id = p_msg[i];
+      if(field_id >= p_cat->nfields) return -1;
+
+      size = bb_type_size(p_cat->types[field_id]);
+      if(size == 0 || i + 1 + size > msgLen) return -1;
+
+      series = bb_store_series(p_store, link, field_id, p_cat->types[field_id]);
+      if(series != BB_STORE_NO_SERIES &&
+	 bb_store_append(p_store, series, time, &(p_msg[i + 1])) == 0)
+	count += 1;
+
+      i += 1 + size;
+    }
+
+  return count;
+}
+
+
+// Newest sample of a series. Returns 0, or -1 if it has none.
+int8_t bb_store_latest(bbStore* p_store, uint32_t series, uint32_t* p_time, double* p_value)
+{
+  bbStoreSeries* p_series;
+  bbStoreChunk* p_chunk;
+
+  if(series >= p_store->nseries || p_store->p_series[series].nchunks == 0) return -1;
+
+  p_series = &(p_store->p_series[series]);
+  p_chunk = p_series->p_chunks[p_series->nchunks - 1];
+
+  *p_time = p_chunk->t_last;
+  *p_value = bb_store_get(p_series->type, p_chunk->values, p_chunk->n - 1);
+  return 0;
+}
+
+// Copies samples w/ t0 <= time <= t1, oldest first, up to maxSamples.
+// Returns number copied.
+uint32_t bb_store_range(bbStore* p_store, uint32_t series, uint32_t t0, uint32_t t1,
+			uint32_t* p_times, double* p_values, uint32_t maxSamples)
+{
+  bbStoreSeries* p_series;
+  bbStoreChunk* p_chunk;
+  uint32_t c, i;
+  uint32_t count = 0;
+
+  if(series >= p_store->nseries) return 0;
+  p_series = &(p_store->p_series[series]);
+
+  for(c = bb_store_first_chunk(p_series, t0); c < p_series->nchunks; c++)
+    {
+      p_chunk = p_series->p_chunks[c];
+      if(p_chunk->t_first > t1) break;
+
+      i = (p_chunk->t_first >= t0) ? 0 : bb_store_first_sample(p_chunk, t0);
+      for(; i < p_chunk->n && p_chunk->times[i] <= t1; i++)
+	{
+	  if(count == maxSamples) return count;
+
+	  p_times[count] = p_chunk->times[i];
+	  p_values[count] = bb_store_get(p_series->type, p_chunk->values, i);
+	  count += 1;
+	}
+    }
+
+  return count;
+}
+
+// Count, min, max & mean of samples w/ t0 <= time <= t1. Returns 0, or -1
+// if there are none.
+int8_t bb_store_aggregate(bbStore* p_store, uint32_t series, uint32_t t0, uint32_t t1,
+			  bbStoreAgg* p_agg)
+{
+  bbStoreSeries* p_series;
+  bbStoreChunk* p_chunk;
+  uint32_t c, i0, i1;
+  double sum = 0;
+
+  p_agg->count = 0;
+  if(series >= p_store->nseries) return -1;
+  p_series = &(p_store->p_series[series]);
+
+  for(c = bb_store_first_chunk(p_series, t0); c < p_series->nchunks; c++)
+    {
+      p_chunk = p_series->p_chunks[c];
+      if(p_chunk->t_first > t1) break;
+
+      if(p_chunk->t_first >= t0 && p_chunk->t_last <= t1)  //Whole chunk, use summary
+	{
+	  if(p_agg->count == 0 || p_chunk->min < p_agg->min) p_agg->min = p_chunk->min;
+	  if(p_agg->count == 0 || p_chunk->max > p_agg->max) p_agg->max = p_chunk->max;
+	  sum += p_chunk->sum;
+	  p_agg->count += p_chunk->n;
+	  continue;
+	}
+
+      i0 = (p_chunk->t_first >= t0) ? 0 : bb_store_first_sample(p_chunk, t0);
+      i1 = (t1 == 0xffffffff) ? p_chunk->n : bb_store_first_sample(p_chunk, t1 + 1);
+      if(i0 < i1) bb_store_scan(p_series, p_chunk, i0, i1, p_agg, &sum);
+    }
+
+  if(p_agg->count == 0) return -1;
+
+  p_agg->mean = sum / p_agg->count;
+  return 0;
+}
+
+
+//Value i of a chunk's values
+static double bb_store_get(uint8_t type, const uint8_t* p_values, uint32_t i)
+{
+  union { int8_t i8; int16_t i16; int32_t i32; int64_t i64;
+	  uint8_t u8; uint16_t u16; uint32_t u32; uint64_t u64;
+	  float f32; double f64; } v;
+  uint8_t size;
+
+  size = bb_type_size(type);
+  memcpy(&v, &(p_values[i * size]), size);
+
+  switch(type)
+    {
+    case INT8:    return v.i8;
+    case INT16:   return v.i16;
+    case INT32:   return v.i32;
+    case INT64:   return (double)v.i64;
+    case UINT8:   return v.u8;
+    case UINT16:  return v.u16;
+    case UINT32:  return v.u32;
+    case UINT64:  return (double)v.u64;
+    case FLOAT32: return v.f32;
+    case FLOAT64: return v.f64;
+    default:      return 0;
+    }
+}
+
+//Tight loop over one column type, values i0 up to (not incl.) i1
+#define BB_STORE_SCAN(ctype)						\
+  {									\
+    ctype x;								\
+    for(i = i0; i < i1; i++)						\
+      {									\
+	memcpy(&x, &(p_chunk->values[i * sizeof(ctype)]), sizeof(ctype)); \
+	if(p_agg->count == 0 || x < p_agg->min) p_agg->min = x;		\
+	if(p_agg->count == 0 || x > p_agg->max) p_agg->max = x;		\
+	*p_sum += x;							\
+	p_agg->count += 1;						\
+      }									\
+    break;								\
+  }
+
+static void bb_store_scan(bbStoreSeries* p_series, bbStoreChunk* p_chunk,
+			  uint32_t i0, uint32_t i1, bbStoreAgg* p_agg, double* p_sum)
+{
+  uint32_t i;
+
+  switch(p_series->type)
+    {
+    case INT8:    BB_STORE_SCAN(int8_t);
+    case INT16:   BB_STORE_SCAN(int16_t);
+    case INT32:   BB_STORE_SCAN(int32_t);
+    case INT64:   BB_STORE_SCAN(int64_t);
+    case UINT8:   BB_STORE_SCAN(uint8_t);
+    case UINT16:  BB_STORE_SCAN(uint16_t);
+    case UINT32:  BB_STORE_SCAN(uint32_t);
+    case UINT64:  BB_STORE_SCAN(uint64_t);
+    case FLOAT32: BB_STORE_SCAN(float);
+    case FLOAT64: BB_STORE_SCAN(double);
+    default:      break;
+    }
+}
+
+//First chunk w/ any sample at or after t0, nchunks if none
+static uint32_t bb_store_first_chunk(bbStoreSeries* p_series, uint32_t t0)
+{
+  uint32_t lo = 0;
+  uint32_t hi = p_series->nchunks;
+  uint32_t mid;
+
+  while(lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if(p_series->p_chunks[mid]->t_last < t0) lo = mid + 1;
+      else hi = mid;
+    }
+
+  return lo;
+}
+
+//First sample in chunk at or after t0, n if none
+static uint32_t bb_store_first_sample(bbStoreChunk* p_chunk, uint32_t t0)
+{
+  uint32_t lo = 0;
+  uint32_t hi = p_chunk->n;
+  uint32_t mid;
+
+  while(lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if(p_chunk->times[mid] < t0) lo = mid + 1;
+      else hi = mid;
+    }
+
+  return lo;
+}
+
+
+
+#ifdef UNIT_TEST
+
+#include <time.h>  //Needed to time queries
+
+#define TEST_NLINKS   4
+#define TEST_NFRAMES  1000000   //Per link, ~3 hours at 100 frames/sec
+#define TEST_PERIOD   10        //ms between frames
+
+//Stand-in for babelbits.c so the test links alone
+uint8_t bb_type_size(enum Datatype type)
+{
+  switch(type)
+    {
+    case INT8:  case UINT8:                 return 1;
+    case INT16: case UINT16:                return 2;
+    case INT32: case UINT32: case FLOAT32:  return 4;
+    case INT64: case UINT64: case FLOAT64:  return 8;
+    default:                                return 0;
+    }
+}
+
+bbStore store;
+
+void main()
+{
+  bbCatalog cat;
+  bbStoreAgg agg;
+  uint8_t msg[1 + 4 + 1 + 2];
+  uint16_t link;
+  uint32_t i, t, n;
+  int32_t count;
+  int16_t temp;
+  uint32_t series;
+  double sum, mn, mx, value;
+  uint32_t* p_times;
+  double* p_values;
+  uint8_t result = 0;
+  clock_t start;
+
+  //Each link sends | 0 | INT32 counter | 1 | INT16 temperature |
+  cat.nfields = 2;
+  cat.types[0] = INT32;
+  cat.types[1] = INT16;
+
+  printf("Storing %d frames from each of %d links...\n", TEST_NFRAMES, TEST_NLINKS);
+  bb_store_init(&store, 0, 0);
+
+  start = clock();
+  for(i = 0; i < TEST_NFRAMES; i++)
+    for(link = 0; link < TEST_NLINKS; link++)
+      {
+	count = i + link;
+	temp = (int16_t)((i * 7 + link) % 1000) - 500;
+	msg[0] = 0;
+	memcpy(&msg[1], &count, 4);
+	msg[5] = 1;
+	memcpy(&msg[6], &temp, 2);
+	if(bb_store_tmpacket(&store, link, &cat, i * TEST_PERIOD, msg, sizeof(msg)) != 2)
+	  result |= 0x01;
+      }
+  printf("Ingest: %.1f M samples/sec\n", 2.0 * TEST_NFRAMES * TEST_NLINKS /
+	 ((double)(clock() - start) / CLOCKS_PER_SEC) / 1e6);
+
+  //Latest
+  series = bb_store_find(&store, 3, 1);
+  if(bb_store_latest(&store, series, &t, &value) != 0 ||
+     t != (TEST_NFRAMES - 1) * TEST_PERIOD ||
+     value != (double)(((TEST_NFRAMES - 1) * 7 + 3) % 1000) - 500)
+    result |= 0x02;
+
+  //Range: one minute from minute 47
+  p_times = malloc(6000 * sizeof(uint32_t));
+  p_values = malloc(6000 * sizeof(double));
+  n = bb_store_range(&store, bb_store_find(&store, 1, 0), 47 * 60000, 48 * 60000 - 1,
+		     p_times, p_values, 6000);
+  if(n != 6000 || p_times[0] != 47 * 60000 || p_values[0] != 47 * 6000 + 1)
+    result |= 0x04;
+
+  //Aggregate over an odd span, checked against a brute-force pass
+  sum = 0;
+  mn = 1e9;
+  mx = -1e9;
+  for(i = 12345; i <= 876543; i++)
+    {
+      value = (double)((i * 7 + 3) % 1000) - 500;
+      sum += value;
+      if(value < mn) mn = value;
+      if(value > mx) mx = value;
+    }
+
+  start = clock();
+  for(i = 0; i < 1000; i++)
+    bb_store_aggregate(&store, series, 12345 * TEST_PERIOD, 876543 * TEST_PERIOD, &agg);
+  printf("Aggregate over %d samples: %.1f us\n", (int)agg.count,
+	 1e6 * (double)(clock() - start) / CLOCKS_PER_SEC / 1000);
+
+  if(agg.count != 876543 - 12345 + 1 || agg.min != mn || agg.max != mx ||
+     agg.mean - sum / agg.count > 1e-9 || sum / agg.count - agg.mean > 1e-9)
+    result |= 0x08;
+
+  bb_store_free(&store);
+
+  //Retention: keep about the last 10 s of each series
+  bb_store_init(&store, 10000, 0);
+  for(i = 0; i < 100000; i++)
+    {
+      count = i;
+      series = bb_store_series(&store, 0, 0, INT32);
+      bb_store_append(&store, series, i * TEST_PERIOD, &count);
+    }
+  if(store.p_series[0].nsamples > 10000 / TEST_PERIOD + 1 + 2 * BB_STORE_CHUNKLEN ||
+     bb_store_range(&store, 0, 0, 500000, p_times, p_values, 1) != 0 ||
+     bb_store_aggregate(&store, 0, 0, 0xffffffff, &agg) != 0 ||
+     agg.max != 99999)
+    result |= 0x10;
+  bb_store_free(&store);
+
+  free(p_times);
+  free(p_values);
+
+  if(result == 0)
+    printf("\nTime-series store:\t\t --PASSED--\n");
+  else
+    printf("\nTime-series store:\t\t --FAILED-- (0x%02x)\n", result);
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    babelbits_store.h
+ *
+ * Description: Header file for babelbits_store.c
+ *
+ *
+ * Test configuration: See babelbits_store.c
+ *--------------------------------------------------------------------*/
+
+#ifndef BB_STORE_CHUNKLEN
+#define BB_STORE_CHUNKLEN 4096     //Samples per chunk
+#endif
+#define BB_STORE_NO_SERIES 0xffffffff
+
+
+//Run of consecutive samples of one series, oldest first. Summary is kept
+//up to date on append so aggregates skip over whole chunks.
+typedef struct
+{
+  uint32_t n;
+  uint32_t t_first;
+  uint32_t t_last;
+  double   min;
+  double   max;
+  double   sum;
+
+  uint32_t times[BB_STORE_CHUNKLEN];
+  uint8_t  values[];       //n values, native, packed at type size
+} bbStoreChunk;
+
+//All samples of one field from one link
+typedef struct
+{
+  uint16_t link;
+  uint8_t  field_id;
+  uint8_t  type;           //enum Datatype
+  uint8_t  size;
+
+  bbStoreChunk** p_chunks; //Oldest first, the last one is being filled
+  uint32_t nchunks;
+  uint32_t chunks_cap;
+  uint64_t nsamples;
+} bbStoreSeries;
+
+typedef struct
+{
+  bbStoreSeries* p_series;
+  uint32_t nseries;
+  uint32_t series_cap;
+
+  //Series index + 1 (0 = none) at [link * BB_MAX_NFIELDS + field_id]
+  uint32_t* p_map;
+  uint32_t map_len;
+
+  //Retention, 0 = unlimited. Enforced a whole chunk at a time.
+  uint32_t retention;      //Keep samples this much older than newest
+  uint64_t max_samples;    //Per series
+} bbStore;
+
+typedef struct
+{
+  uint64_t count;
+  double   min;
+  double   max;
+  double   mean;
+} bbStoreAgg;
+
+
+void bb_store_init(bbStore* p_store, uint32_t retention, uint64_t max_samples);
+void bb_store_free(bbStore* p_store);
+uint32_t bb_store_series(bbStore* p_store, uint16_t link, uint8_t field_id, uint8_t type);
+uint32_t bb_store_find(bbStore* p_store, uint16_t link, uint8_t field_id);
+int8_t bb_store_append(bbStore* p_store, uint32_t series, uint32_t time, const void* p_value);
+int16_t bb_store_tmpacket(bbStore* p_store, uint16_t link, bbCatalog* p_cat, uint32_t time,
+			  uint8_t* p_msg, uint16_t msgLen);
+
+int8_t bb_store_latest(bbStore* p_store, uint32_t series, uint32_t* p_time, double* p_value);
+uint32_t bb_store_range(bbStore* p_store, uint32_t series, uint32_t t0, uint32_t t1,
+			uint32_t* p_times, double* p_values, uint32_t maxSamples);
+int8_t bb_store_aggregate(bbStore* p_store, uint32_t series, uint32_t t0, uint32_t t1,
+			  bbStoreAgg* p_agg);
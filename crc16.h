@@ -0,0 +1,65 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    crc16.h
+ *
+ * Description: CRC16 used by hermes.c for CRC16 packets.
+ *              CRC-16/CCITT-FALSE: poly 0x1021, init 0xffff, no
+ *              reflection, no final xor. Bit-by-bit, so it needs no
+ *              table in flash. Header only, so hermes.c builds alone.
+ *
+ * Usage:  crc = crc16_init();
+ *         crc = crc16_update(crc, p_data, len);   //As many times as needed
+ *         crc = crc16_finalize(crc);
+ *
+ * Check value: "123456789" gives 0x29b1
+ *
+ *--------------------------------------------------------------------
+ *                  Copyright 2011, Scott Nietfeld
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *--------------------------------------------------------------------*/
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint16_t crc16_t;
+
+static inline crc16_t crc16_init(void)
+{
+  return 0xffff;
+}
+
+static inline crc16_t crc16_update(crc16_t crc, const void* p_data, size_t len)
+{
+  const uint8_t* p_cur = (const uint8_t*)p_data;
+  uint8_t bit;
+
+  while( len-- )
+    {
+      crc ^= (crc16_t)(*p_cur++) << 8;
+      for(bit = 0; bit < 8; bit++)
+	crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+
+  return crc;
+}
+
+static inline crc16_t crc16_finalize(crc16_t crc)
+{
+  return crc;
+}
+
+#endif
@@ -11,6 +11,13 @@
  *
  * packetLen - Length of entire packet, including sync, type, len, msg, & checksum
  *    msgLen - Length of inner message ONLY. No sync, type, len, or checksum
+ *
+ * Streaming mode: if stream handlers are set w/ hermes_setStreamHandlers(),
+ * the inner message is handed to the user in chunks as it arrives instead
+ * of all at once, so p_inBuf only needs to be big enough for the header
+ * plus one chunk. Chunks are as big as the rest of p_inBuf allows. The
+ * end handler is told whether the checksum/crc passed, so the user should
+ * hold off acting on the data until then.
  *    
  *
  * Test configuration: uncomment "#define UNIT_TEST"
@@ -57,6 +64,12 @@ int inBufLen, outBufLen;
 // called whenever a message is finished being read in.
 void (*p_msgHandler)(uint8_t* p_msg, uint16_t msgLen);
 
+// Optional streaming handlers. If p_streamChunk is set, messages are
+// delivered through these instead of p_msgHandler.
+void (*p_streamBegin)(uint8_t formatID, uint16_t msgLen);
+void (*p_streamChunk)(uint8_t* p_chunk, uint16_t chunkLen);
+void (*p_streamEnd)(uint8_t goodCheck);
+
 
 uint8_t checksum8(uint8_t* p_msg, uint16_t len);
 uint16_t checksum16(uint8_t* p_msg, uint16_t len);
@@ -79,6 +92,15 @@ void hermes_init(uint8_t* p_newInBuf,  uint16_t newInBufLen,
   p_msgHandler = p_newMsgHandler;
 }
 
+void hermes_setStreamHandlers(void (*p_newBegin)(uint8_t formatID, uint16_t msgLen),
+			      void (*p_newChunk)(uint8_t* p_chunk, uint16_t chunkLen),
+			      void (*p_newEnd)(uint8_t goodCheck))
+{
+  p_streamBegin = p_newBegin;
+  p_streamChunk = p_newChunk;
+  p_streamEnd   = p_newEnd;
+}
+
 void hermes_processChar(uint8_t c)
 {
   static uint8_t synced = 0;
@@ -95,6 +117,72 @@ void hermes_processChar(uint8_t c)
   static crc16_t calcd_crc16;      //Only used if using CRC16 checking
   static uint8_t good_check;       //Boolean to tell if checksum/crc is good
 
+  static uint16_t msgLen;          //Only used in streaming mode
+  static uint16_t chunkLen;
+  static uint8_t rxdCheck[2];
+
+
+  //Streaming mode: payload goes out in chunks, only header stays in p_inBuf
+  if (synced == 2 && headerReceived && p_streamChunk != 0)
+    {
+      if (count < HEADERLEN + msgLen)   //Payload byte, add to current chunk
+	{
+	  p_inBuf[HEADERLEN + chunkLen] = c;
+	  ++chunkLen;
+	  ++count;
+
+	  //Chunk full or payload done--update running check & pass it on
+	  if (chunkLen >= inBufLen - HEADERLEN || count == HEADERLEN + msgLen)
+	    {
+	      calcdChecksum += checksum16(&(p_inBuf[HEADERLEN]), chunkLen);
+	      if (checkType == CRC16)
+		calcd_crc16 = crc16_update(calcd_crc16, &(p_inBuf[HEADERLEN]), chunkLen);
+
+	      p_streamChunk(&(p_inBuf[HEADERLEN]), chunkLen);
+	      chunkLen = 0;
+	    }
+	}
+      else   //Checksum byte
+	{
+	  rxdCheck[count - HEADERLEN - msgLen] = c;
+	  ++count;
+	}
+
+      if (count >= packetLen)
+	{
+	  switch( checkType )
+	    {
+	    case CHECKSUM8:
+	      good_check = (rxdCheck[0] == (calcdChecksum & 0x00ff)) ? 1 : 0;
+	      break;
+
+	    case CHECKSUM16:
+	      rxdChecksum = (rxdCheck[0] << 8) | rxdCheck[1];
+	      good_check = (rxdChecksum == (calcdChecksum & 0xffff)) ? 1 : 0;
+	      break;
+
+	    case CRC16:
+	      rxd_crc16 = (rxdCheck[0] << 8) | rxdCheck[1];
+	      calcd_crc16 = crc16_finalize(calcd_crc16);
+	      good_check = (rxd_crc16 == calcd_crc16) ? 1 : 0;
+	      break;
+
+	    default:
+	      good_check = 1;
+	    }
+
+	  if (p_streamEnd != 0) p_streamEnd(good_check);
+
+	  //Done with this message, reset variables for next one
+	  synced         = 0;
+	  headerReceived = 0;
+	  count          = 0;
+	  formatID       = 0;
+	  packetLen      = 0;
+	}
+      return;
+    }
+
 
   if (synced == 2)
     {
@@ -181,8 +269,11 @@ void hermes_processChar(uint8_t c)
 	  packetLen  = (p_inBuf[3] << 8) + p_inBuf[4];   //Parse message length
 
 
-	  //Do some basic checks to see if header is sane
-	  if (packetLen >= inBufLen || packetLen > MAX_PACKETLEN || packetLen < MIN_PACKETLEN)
+	  //Do some basic checks to see if header is sane. Streaming mode
+	  //only needs room for the header and a chunk, not the whole packet.
+	  if ((p_streamChunk == 0 && packetLen >= inBufLen) ||
+	      (p_streamChunk != 0 && inBufLen <= HEADERLEN) ||
+	      packetLen > MAX_PACKETLEN || packetLen < MIN_PACKETLEN)
 	    {
 	      //Message is too long, just scrap it & start over
 	      //printf("\nOversized packet. Scrapping");
@@ -226,6 +317,40 @@ void hermes_processChar(uint8_t c)
 	  /*printf("formatID: %d \t packetLen: %x \t checkLen: %d\n", 
 	    formatID, packetLen, checkLen); */
 
+	  if (p_streamChunk != 0)
+	    {
+	      if (packetLen < HEADERLEN + checkLen)  //No room for checksum, scrap it
+		{
+		  synced         = 0;
+		  headerReceived = 0;
+		  count          = 0;
+		  formatID       = 0;
+		  packetLen      = 0;
+		  return;
+		}
+
+	      //Start running check w/ the header bytes it covers
+	      msgLen = packetLen - HEADERLEN - checkLen;
+	      chunkLen = 0;
+	      calcdChecksum = checksum16(&(p_inBuf[2]), HEADERLEN - 2);
+	      calcd_crc16 = crc16_init();
+	      calcd_crc16 = crc16_update(calcd_crc16, &(p_inBuf[2]), HEADERLEN - 2);
+
+	      if (p_streamBegin != 0) p_streamBegin(formatID, msgLen);
+
+	      if (packetLen == HEADERLEN)  //Empty & unchecked, nothing more to wait for
+		{
+		  if (p_streamEnd != 0) p_streamEnd(1);
+
+		  synced         = 0;
+		  headerReceived = 0;
+		  count          = 0;
+		  formatID       = 0;
+		  packetLen      = 0;
+		  return;
+		}
+	    }
+
 	  headerReceived = 1;
 	}
       
@@ -396,6 +521,11 @@ uint8_t msgReadSuccess  = 1;
 uint8_t msgWriteSuccess = 1;
 uint8_t randIOSuccess = 1;
 
+uint8_t  streamBuf[1024];    //Chunks get reassembled here to check them
+uint16_t streamLen   = 0;
+uint16_t streamChunks = 0;
+uint8_t  streamGood  = 0;
+
 void processMessage(uint8_t* p_msg, uint16_t msgLen)
 {
   uint16_t i, j;
@@ -424,6 +554,29 @@ void processMessage(uint8_t* p_msg, uint16_t msgLen)
     }
 }
 
+void streamBegin(uint8_t formatID, uint16_t msgLen)
+{
+  streamLen = 0;
+  streamChunks = 0;
+  streamGood = 0;
+}
+
+void streamChunk(uint8_t* p_chunk, uint16_t chunkLen)
+{
+  uint16_t i;
+
+  for(i = 0; i < chunkLen; i++)
+    streamBuf[streamLen + i] = p_chunk[i];
+
+  streamLen += chunkLen;
+  streamChunks += 1;
+}
+
+void streamEnd(uint8_t goodCheck)
+{
+  streamGood = goodCheck;
+}
+
 
 uint8_t hermes_unit(void)
 {
@@ -505,6 +658,36 @@ uint8_t hermes_unit(void)
       if( randIOSuccess == 0 ) result |= 0x04;
     }
 
+
+  //Stream a big packet through a small input buffer
+  hermes_init( inPacketBuf, 37, outPacketBuf, 1024, &processMessage);
+  hermes_setStreamHandlers(&streamBegin, &streamChunk, &streamEnd);
+
+  msgLen = 1000;
+  for(j = 0; j < msgLen; j++){
+    msgBuf[j] = rand() % 256;
+  }
+  packetLen = hermes_makePacket(CRC16, msgBuf, msgLen, outPacketBuf);
+
+  for(j = 0; j < packetLen; j++){
+    hermes_processChar(outPacketBuf[j]);
+  }
+  if( streamGood != 1 || streamLen != msgLen || streamChunks != 32 ) result |= 0x08;
+  for(j = 0; j < msgLen; j++){
+    if( streamBuf[j] != msgBuf[j] ) result |= 0x08;
+  }
+
+  //Corrupted payload must still stream, but end w/ a failed check
+  packetLen = hermes_makePacket(CHECKSUM16, msgBuf, msgLen, outPacketBuf);
+  outPacketBuf[HEADERLEN + 500] ^= 0x01;
+  for(j = 0; j < packetLen; j++){
+    hermes_processChar(outPacketBuf[j]);
+  }
+  if( streamGood != 0 || streamLen != msgLen ) result |= 0x08;
+
+  hermes_setStreamHandlers(0, 0, 0);
+  hermes_init( inPacketBuf, 1024, outPacketBuf, 1024, &processMessage);
+
   return result; //Successful test
 }
 
@@ -535,6 +718,11 @@ void main(void)
   else
     printf("\nRandom packet stuffing & parsing:\t --PASSED--");
 
+  if( result & 0x08 )
+    printf("\nStreaming packet parsing:\t\t --FAILED--");
+  else
+    printf("\nStreaming packet parsing:\t\t --PASSED--");
+
   
 
   // Begin reading in characters from the keyboard
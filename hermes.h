@@ -48,6 +48,10 @@ void hermes_init(uint8_t* p_newInBuf,  uint16_t newInBufLen,
 		 uint8_t* p_newOutBuf, uint16_t newOutBufLen,
 		 void (*p_msgHandler)(uint8_t* p_msg, uint16_t msgLen));
 		 
+void hermes_setStreamHandlers(void (*p_newBegin)(uint8_t formatID, uint16_t msgLen),
+			      void (*p_newChunk)(uint8_t* p_chunk, uint16_t chunkLen),
+			      void (*p_newEnd)(uint8_t goodCheck));
+
 void hermes_processChar(uint8_t c);
 
 int hermes_makePacket(uint8_t  checkType, 
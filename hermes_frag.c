@@ -0,0 +1,390 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    hermes_frag.c
+ *
+ *
+ * Description: Splits transfers too big for one hermes packet into
+ *              fragments, and reassembles them on the other end.
+ *
+ * Fragment format (carried as the inner message of a hermes packet):
+ *
+ *       | xferID | fragLen | totalLen | offset | payload |
+ *
+ *   xferID - Identifies the transfer. Fragments w/ a new ID restart rx.
+ *  fragLen - Payload bytes in every fragment but the last
+ * totalLen - Length of the whole transfer
+ *   offset - Where this payload goes in the transfer, multiple of fragLen
+ *
+ * All header fields are big-endian, same as the hermes header. Fragments
+ * may arrive in any order; lost ones can be found w/ fragRxNextMissing()
+ * and regenerated by the sender w/ fragTxMake(). Fragments are ordinary
+ * hermes messages, so the user decides how to route them to fragRx.
+ *
+ * Test configuration: uncomment "#define UNIT_TEST"
+ *                     gcc -o hermes_frag.exe hermes_frag.c
+ *                     run
+ *
+ *--------------------------------------------------------------------
+ *                  Copyright 2011, Scott Nietfeld
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *--------------------------------------------------------------------*/
+
+//#define UNIT_TEST
+
+#ifdef UNIT_TEST
+#include <stdio.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>  //Needed for memcpy/memset
+
+#include "hermes_frag.h"
+
+
+//----------------Private Functions & Variables-----------------//
+
+static uint32_t fragCount(uint32_t totalLen, uint16_t fragLen);
+
+//--------------------------------------------------------------//
+
+
+
+//----------------------Public Functions------------------------//
+void hermes_fragTxInit(hermesFragTx* p_tx, uint16_t xferID,
+		       uint8_t* p_data, uint32_t dataLen, uint16_t fragLen)
+{
+  p_tx->p_data  = p_data;
+  p_tx->dataLen = dataLen;
+
+  p_tx->xferID   = xferID;
+  p_tx->fragLen  = fragLen;
+  p_tx->nfrags   = fragCount(dataLen, fragLen);
+  p_tx->nextFrag = 0;
+}
+
+// Builds fragment fragIdx into p_outMsg. Returns message length,
+// or 0 if fragment doesn't exist or won't fit in outMsgLen.
+int hermes_fragTxMake(hermesFragTx* p_tx, uint32_t fragIdx,
+		      uint8_t* p_outMsg, uint16_t outMsgLen)
+{
+  uint32_t offset;
+  uint32_t payloadLen;
+
+  if( p_tx->fragLen == 0 || fragIdx >= p_tx->nfrags ) return 0;
+
+  offset = fragIdx * p_tx->fragLen;
+  payloadLen = p_tx->dataLen - offset;
+  if( payloadLen > p_tx->fragLen ) payloadLen = p_tx->fragLen;
+
+  if( FRAG_HEADERLEN + payloadLen > outMsgLen ) return 0;
+
+  p_outMsg[0]  = (p_tx->xferID >> 8) & 0x00ff;
+  p_outMsg[1]  = p_tx->xferID & 0x00ff;
+  p_outMsg[2]  = (p_tx->fragLen >> 8) & 0x00ff;
+  p_outMsg[3]  = p_tx->fragLen & 0x00ff;
+  p_outMsg[4]  = (p_tx->dataLen >> 24) & 0x00ff;
+  p_outMsg[5]  = (p_tx->dataLen >> 16) & 0x00ff;
+  p_outMsg[6]  = (p_tx->dataLen >> 8) & 0x00ff;
+  p_outMsg[7]  = p_tx->dataLen & 0x00ff;
+  p_outMsg[8]  = (offset >> 24) & 0x00ff;
+  p_outMsg[9]  = (offset >> 16) & 0x00ff;
+  p_outMsg[10] = (offset >> 8) & 0x00ff;
+  p_outMsg[11] = offset & 0x00ff;
+
+  memcpy(&p_outMsg[FRAG_HEADERLEN], &p_tx->p_data[offset], payloadLen);
+
+  return FRAG_HEADERLEN + payloadLen;
+}
+
+// Builds the next fragment in sequence. Returns 0 once all are sent.
+int hermes_fragTxNext(hermesFragTx* p_tx, uint8_t* p_outMsg, uint16_t outMsgLen)
+{
+  int msgLen;
+
+  msgLen = hermes_fragTxMake(p_tx, p_tx->nextFrag, p_outMsg, outMsgLen);
+  if( msgLen > 0 ) p_tx->nextFrag += 1;
+
+  return msgLen;
+}
+
+
+void hermes_fragRxInit(hermesFragRx* p_rx,
+		       uint8_t* p_dest,   uint32_t destLen,
+		       uint8_t* p_bitmap, uint32_t bitmapLen,
+		       void (*p_doneHandler)(uint8_t* p_data, uint32_t dataLen))
+{
+  p_rx->p_dest    = p_dest;
+  p_rx->destLen   = destLen;
+  p_rx->p_bitmap  = p_bitmap;
+  p_rx->bitmapLen = bitmapLen;
+
+  p_rx->active    = 0;
+  p_rx->xferID    = 0;
+  p_rx->fragLen   = 0;
+  p_rx->totalLen  = 0;
+  p_rx->nfrags    = 0;
+  p_rx->nreceived = 0;
+
+  p_rx->p_doneHandler = p_doneHandler;
+}
+
+uint8_t hermes_fragRxProcessMessage(hermesFragRx* p_rx, uint8_t* p_msg, uint16_t msgLen)
+{
+  uint16_t xferID;
+  uint16_t fragLen;
+  uint32_t totalLen;
+  uint32_t offset;
+  uint32_t payloadLen;
+  uint32_t expectedLen;
+  uint32_t fragIdx;
+  uint8_t  mask;
+
+  if( msgLen < FRAG_HEADERLEN ) return FRAG_ERROR;
+
+  //Parse fragment header
+  xferID   = (p_msg[0] << 8) | p_msg[1];
+  fragLen  = (p_msg[2] << 8) | p_msg[3];
+  totalLen = ((uint32_t)p_msg[4] << 24) | ((uint32_t)p_msg[5] << 16)
+           | ((uint32_t)p_msg[6] << 8)  |  (uint32_t)p_msg[7];
+  offset   = ((uint32_t)p_msg[8] << 24) | ((uint32_t)p_msg[9] << 16)
+           | ((uint32_t)p_msg[10] << 8) |  (uint32_t)p_msg[11];
+  payloadLen = msgLen - FRAG_HEADERLEN;
+
+  if( fragLen == 0 ) return FRAG_ERROR;
+
+  //Fragment from a different transfer--drop whatever we had & start over
+  if( !p_rx->active || xferID != p_rx->xferID ||
+      fragLen != p_rx->fragLen || totalLen != p_rx->totalLen )
+    {
+      p_rx->active = 0;
+
+      if( totalLen > p_rx->destLen ||
+	  (fragCount(totalLen, fragLen) + 7) / 8 > p_rx->bitmapLen )
+	return FRAG_ERROR;  //Won't fit in caller's memory
+
+      p_rx->xferID    = xferID;
+      p_rx->fragLen   = fragLen;
+      p_rx->totalLen  = totalLen;
+      p_rx->nfrags    = fragCount(totalLen, fragLen);
+      p_rx->nreceived = 0;
+      memset(p_rx->p_bitmap, 0, (p_rx->nfrags + 7) / 8);
+
+      p_rx->active = 1;
+    }
+
+  //Make sure fragment lands exactly on a fragment boundary
+  if( offset % fragLen != 0 ) return FRAG_ERROR;
+  fragIdx = offset / fragLen;
+  if( fragIdx >= p_rx->nfrags ) return FRAG_ERROR;
+
+  expectedLen = totalLen - offset;
+  if( expectedLen > fragLen ) expectedLen = fragLen;
+  if( payloadLen != expectedLen ) return FRAG_ERROR;
+
+  mask = 1 << (fragIdx & 0x07);
+  if( p_rx->p_bitmap[fragIdx >> 3] & mask ) return FRAG_DUPLICATE;
+
+  memcpy(&p_rx->p_dest[offset], &p_msg[FRAG_HEADERLEN], payloadLen);
+  p_rx->p_bitmap[fragIdx >> 3] |= mask;
+  p_rx->nreceived += 1;
+
+  if( p_rx->nreceived < p_rx->nfrags ) return FRAG_ACCEPTED;
+
+  //Got them all, pass transfer to user. Done w/ it, so a later transfer
+  //is new even if it reuses this one's ID (e.g. after IDs wrap).
+  p_rx->active = 0;
+  if( p_rx->p_doneHandler != 0 )
+    p_rx->p_doneHandler(p_rx->p_dest, p_rx->totalLen);
+
+  return FRAG_COMPLETE;
+}
+
+// Returns index of first missing fragment at or after startIdx, or
+// nfrags if none are missing (incl. once transfer is delivered). Use to
+// ask the sender for resends.
+uint32_t hermes_fragRxNextMissing(hermesFragRx* p_rx, uint32_t startIdx)
+{
+  uint32_t i;
+
+  if( !p_rx->active ) return p_rx->nfrags;
+
+  i = startIdx;
+  while( i < p_rx->nfrags )
+    {
+      //Skip over fully received bytes of the bitmap 8 fragments at a time
+      if( (i & 0x07) == 0 && p_rx->p_bitmap[i >> 3] == 0xff )
+	{
+	  i += 8;
+	  continue;
+	}
+
+      if( !(p_rx->p_bitmap[i >> 3] & (1 << (i & 0x07))) ) return i;
+      ++i;
+    }
+
+  return p_rx->nfrags;
+}
+//---------------------------------------------------------------//
+
+
+
+//-----------------------Private Functions-----------------------//
+
+//Zero-length transfers still take one (empty) fragment
+static uint32_t fragCount(uint32_t totalLen, uint16_t fragLen)
+{
+  if( fragLen == 0 ) return 0;
+  if( totalLen == 0 ) return 1;
+
+  return FRAG_COUNT(totalLen, fragLen);
+}
+//---------------------------------------------------------------//
+
+
+
+//-----------------------UNIT TEST CODE--------------------------//
+#ifdef UNIT_TEST
+
+#include <stdlib.h>  //need rand()
+
+#define TEST_XFERLEN 300000
+#define TEST_FRAGLEN 1000
+
+uint8_t srcBuf[TEST_XFERLEN];
+uint8_t destBuf[TEST_XFERLEN];
+uint8_t rxBitmap[FRAG_BITMAPLEN(TEST_XFERLEN, TEST_FRAGLEN)];
+
+uint8_t doneCount = 0;
+
+void xferDone(uint8_t* p_data, uint32_t dataLen)
+{
+  doneCount += 1;
+  printf("\nTransfer of %d bytes complete", dataLen);
+}
+
+
+uint8_t hermes_fragUnit(void)
+{
+  hermesFragTx tx;
+  hermesFragRx rx;
+  uint8_t fragMsg[FRAG_HEADERLEN + TEST_FRAGLEN];
+  uint32_t i, idx;
+  int msgLen;
+  uint8_t status;
+  uint8_t result = 0x00;
+
+  for(i = 0; i < TEST_XFERLEN; i++)
+    srcBuf[i] = rand() % 256;
+
+  hermes_fragTxInit(&tx, 1, srcBuf, TEST_XFERLEN, TEST_FRAGLEN);
+  hermes_fragRxInit(&rx, destBuf, sizeof(destBuf),
+		    rxBitmap, sizeof(rxBitmap), &xferDone);
+
+
+  //Send every fragment back-to-front, losing about 1 in 5
+  for(i = tx.nfrags; i > 0; i--)
+    {
+      msgLen = hermes_fragTxMake(&tx, i - 1, fragMsg, sizeof(fragMsg));
+      if( msgLen == 0 ) result |= 0x01;
+
+      if( rand() % 5 == 0 ) continue;
+      hermes_fragRxProcessMessage(&rx, fragMsg, msgLen);
+    }
+  if( doneCount != 0 || rx.nreceived == rx.nfrags ) result |= 0x01;
+
+
+  //Resend whatever receiver reports missing
+  idx = hermes_fragRxNextMissing(&rx, 0);
+  while( idx < rx.nfrags )
+    {
+      msgLen = hermes_fragTxMake(&tx, idx, fragMsg, sizeof(fragMsg));
+      hermes_fragRxProcessMessage(&rx, fragMsg, msgLen);
+      idx = hermes_fragRxNextMissing(&rx, idx);
+    }
+  if( doneCount != 1 || memcmp(srcBuf, destBuf, TEST_XFERLEN) != 0 ) result |= 0x02;
+
+
+  //Stale fragment from finished transfer must not complete it again.
+  //It starts a new transfer, so a second copy is a duplicate.
+  msgLen = hermes_fragTxMake(&tx, 0, fragMsg, sizeof(fragMsg));
+  status = hermes_fragRxProcessMessage(&rx, fragMsg, msgLen);
+  if( status == FRAG_COMPLETE || doneCount != 1 ) result |= 0x04;
+  status = hermes_fragRxProcessMessage(&rx, fragMsg, msgLen);
+  if( status != FRAG_DUPLICATE || doneCount != 1 ) result |= 0x04;
+
+
+  //Transfer reusing a finished one's ID, fragLen & totalLen is delivered
+  for(i = 1; i < tx.nfrags; i++)
+    {
+      msgLen = hermes_fragTxMake(&tx, i, fragMsg, sizeof(fragMsg));
+      status = hermes_fragRxProcessMessage(&rx, fragMsg, msgLen);
+    }
+  if( status != FRAG_COMPLETE || doneCount != 2 ||
+      memcmp(srcBuf, destBuf, TEST_XFERLEN) != 0 ) result |= 0x10;
+
+
+  //Oversized transfer must be refused, short odd-length one accepted in order
+  hermes_fragTxInit(&tx, 2, srcBuf, TEST_XFERLEN, 10);
+  msgLen = hermes_fragTxNext(&tx, fragMsg, sizeof(fragMsg));
+  if( hermes_fragRxProcessMessage(&rx, fragMsg, msgLen) != FRAG_ERROR ) result |= 0x08;
+
+  hermes_fragTxInit(&tx, 3, srcBuf, 1234, 100);
+  while( (msgLen = hermes_fragTxNext(&tx, fragMsg, sizeof(fragMsg))) > 0 )
+    status = hermes_fragRxProcessMessage(&rx, fragMsg, msgLen);
+  if( status != FRAG_COMPLETE || doneCount != 3 ) result |= 0x08;
+
+  return result;
+}
+
+void main(void)
+{
+  uint8_t result;
+
+  printf("\nBeginning unit test for hermes_frag.c fragmentation...\n");
+
+  result = hermes_fragUnit();
+
+  printf("\n------------------------------------------------------\n"
+	 "Hermes frag unit test returned with code: 0x%2x\n", result);
+
+  if( result & 0x01 )
+    printf("\nOut-of-order lossy delivery:\t\t --FAILED--");
+  else
+    printf("\nOut-of-order lossy delivery:\t\t --PASSED--");
+
+  if( result & 0x02 )
+    printf("\nResend & reassembly:\t\t\t --FAILED--");
+  else
+    printf("\nResend & reassembly:\t\t\t --PASSED--");
+
+  if( result & 0x04 )
+    printf("\nDuplicate rejection:\t\t\t --FAILED--");
+  else
+    printf("\nDuplicate rejection:\t\t\t --PASSED--");
+
+  if( result & 0x08 )
+    printf("\nNew transfer handling:\t\t\t --FAILED--");
+  else
+    printf("\nNew transfer handling:\t\t\t --PASSED--");
+
+  if( result & 0x10 )
+    printf("\nReused transfer ID:\t\t\t --FAILED--");
+  else
+    printf("\nReused transfer ID:\t\t\t --PASSED--");
+  printf("\n");
+}
+
+#endif
+//------------------------End Unit Test Code--------------------//
@@ -0,0 +1,96 @@
+/*---------------------------------------------------------------------*
+ * Project Name: babelbits
+ * File name:    hermes_frag.h
+ *
+ * Description: Header file for hermes_frag.c
+ *
+ *
+ * Test configuration: See hermes_frag.c
+ *
+ *--------------------------------------------------------------------
+ *                  Copyright 2011, Scott Nietfeld
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *--------------------------------------------------------------------*/
+#include <stdint.h>
+
+#define FRAG_HEADERLEN 12  //Includes xferID(2), fragLen(2), totalLen(4), offset(4)
+
+//Number of fragments needed to carry totalLen bytes
+#define FRAG_COUNT(totalLen, fragLen) (((totalLen) + (fragLen) - 1) / (fragLen))
+
+//Bytes of bitmap the receiver needs to track every fragment of a transfer
+#define FRAG_BITMAPLEN(totalLen, fragLen) ((FRAG_COUNT(totalLen, fragLen) + 7) / 8)
+
+
+enum
+  {
+    FRAG_ERROR,       //Malformed fragment, or transfer won't fit in rx memory
+    FRAG_ACCEPTED,    //New fragment copied into place
+    FRAG_DUPLICATE,   //Already had this fragment, ignored
+    FRAG_COMPLETE     //Fragment accepted and transfer is now complete
+  };
+
+
+//Outgoing transfer. Sender keeps the whole payload, so any fragment
+//can be regenerated later if the receiver reports it missing.
+typedef struct
+{
+  uint8_t* p_data;
+  uint32_t dataLen;
+
+  uint16_t xferID;     //Identifies transfer, bump for every new one
+  uint16_t fragLen;    //Payload bytes per fragment (last may be shorter)
+  uint32_t nfrags;
+  uint32_t nextFrag;   //Next fragment hermes_fragTxNext() will make
+} hermesFragTx;
+
+//Incoming transfer. Payload is reassembled directly into caller memory.
+typedef struct
+{
+  uint8_t* p_dest;     //Caller-provided reassembly memory
+  uint32_t destLen;
+  uint8_t* p_bitmap;   //Caller-provided, one bit per fragment received
+  uint32_t bitmapLen;
+
+  uint8_t  active;     //Set from first fragment of a transfer until it completes
+  uint16_t xferID;
+  uint16_t fragLen;
+  uint32_t totalLen;
+  uint32_t nfrags;
+  uint32_t nreceived;
+
+  // Called once every fragment of a transfer has been received
+  void (*p_doneHandler)(uint8_t* p_data, uint32_t dataLen);
+} hermesFragRx;
+
+
+void hermes_fragTxInit(hermesFragTx* p_tx, uint16_t xferID,
+		       uint8_t* p_data, uint32_t dataLen, uint16_t fragLen);
+
+int hermes_fragTxMake(hermesFragTx* p_tx, uint32_t fragIdx,
+		      uint8_t* p_outMsg, uint16_t outMsgLen);
+
+int hermes_fragTxNext(hermesFragTx* p_tx, uint8_t* p_outMsg, uint16_t outMsgLen);
+
+void hermes_fragRxInit(hermesFragRx* p_rx,
+		       uint8_t* p_dest,   uint32_t destLen,
+		       uint8_t* p_bitmap, uint32_t bitmapLen,
+		       void (*p_doneHandler)(uint8_t* p_data, uint32_t dataLen));
+
+uint8_t hermes_fragRxProcessMessage(hermesFragRx* p_rx, uint8_t* p_msg, uint16_t msgLen);
+
+uint32_t hermes_fragRxNextMissing(hermesFragRx* p_rx, uint32_t startIdx);
+
+uint8_t hermes_fragUnit(void);